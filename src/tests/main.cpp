@@ -23,9 +23,14 @@
 #include <functional>
 #include "../yasync/future.h"
 #include "../yasync/futuredispatch.h"
+#include "../yasync/futurejoin.h"
+#include "../yasync/futureloop.h"
+#include "../yasync/expected.h"
 #include "../yasync/checkpoint.h"
 #include "../yasync/pool.h"
+#include "../yasync/keyedexecutor.h"
 #include "../yasync/weakref.h"
+#include "../yasync/coroutine.h"
 
 
 
@@ -70,6 +75,26 @@ int main(int , char **) {
 		yasync::halt();
 	};
 
+	tst.test("Thread.cache", "0,1,1,2") >> [](std::ostream &out) {
+		std::uintptr_t ids[3];
+		unsigned int mark = 0;
+		for (int i = 0; i < 3; i++) {
+			yasync::Checkpoint fin;
+			yasync::newThread >> [&ids, &mark, i, fin] {
+				ids[i] = yasync::thisThreadId();
+				//the thread must not inherit alerts of the previous task
+				if (i == 0) yasync::AlertFn::thisThread()();
+				else if (!yasync::sleep(yasync::Timeout::now())) mark++;
+				fin();
+			};
+			fin.wait();
+			yasync::sleep(10);
+		}
+		out << mark << "," << (ids[0] != ids[1] ? 1 : 0) << "," << (ids[1] != ids[2] ? 1 : 0) << ",";
+		yasync::Future<int> f = yasync::newThread >> [] {return 2;};
+		out << f.get();
+	};
+
 	tst.test("Dispatch", "testing") >> [](std::ostream &out) {
 		yasync::AlertFn fin = yasync::AlertFn::thisThread();
 		yasync::thisThread >> [&out, &fin] {
@@ -79,6 +104,78 @@ int main(int , char **) {
 		yasync::haltAndDispatch();
 	};
 
+	tst.test("Dispatch.mpsc", "40000,1") >> [](std::ostream &out) {
+		yasync::DispatchFn me = yasync::DispatchFn::thisThread();
+		unsigned int count = 0;
+		unsigned int last[4] = {0,0,0,0};
+		bool ordered = true;
+		for (unsigned int t = 0; t < 4; t++) {
+			yasync::newThread >> [me, t, &count, &last, &ordered] {
+				for (unsigned int i = 1; i <= 10000; i++) {
+					me >> [t, i, &count, &last, &ordered] {
+						if (last[t] + 1 != i) ordered = false;
+						last[t] = i;
+						count++;
+					};
+				}
+			};
+		}
+		while (count < 40000) yasync::haltAndDispatch();
+		out << count << "," << (ordered ? 1 : 0);
+	};
+
+	tst.test("Dispatch.all", "0,100,10,90,0") >> [](std::ostream &out) {
+		unsigned int count = 0;
+		out << yasync::dispatchAll(yasync::Timeout::now()) << ",";
+		for (unsigned int i = 0; i < 100; i++) yasync::thisThread >> [&count] {count++;};
+		out << yasync::dispatchAll(nullptr) << ",";
+		for (unsigned int i = 0; i < 100; i++) yasync::thisThread >> [&count] {count++;};
+		out << yasync::dispatchAll(nullptr, 10) << ",";
+		out << yasync::dispatchAll(nullptr) << ",";
+		out << yasync::dispatchAll(yasync::Timeout::now());
+	};
+
+	tst.test("Dispatch.alertEmpty", "3,1") >> [](std::ostream &out) {
+		unsigned int count = 0;
+		yasync::sleep(yasync::Timeout::now());
+		yasync::thisThread >> [&count] {
+			count++;
+			yasync::thisThread >> [&count] {count++;};
+		};
+		yasync::thisThread >> [&count] {count++;};
+		//consume the alert of the first function
+		yasync::sleep(yasync::Timeout::now());
+		out << yasync::dispatchAll(yasync::Timeout::now()) << ",";
+		//the function pushed while other function was waiting doesn't alert
+		out << yasync::sleep(yasync::Timeout::now());
+	};
+
+	tst.test("Dispatch.moveOnly", "42,43,44") >> [](std::ostream &out) {
+		struct Job {
+			std::unique_ptr<int> v;
+			std::ostream *out;
+			int *replies;
+			yasync::DispatchFn reply;
+			void operator()() {
+				int x = *v;
+				std::ostream *o = out;
+				int *r = replies;
+				reply >> [o, x, r] {*o << x << ","; ++*r;};
+			}
+		};
+		int replies = 0;
+		yasync::DispatchFn me = yasync::DispatchFn::thisThread();
+		yasync::DispatchFn dt = yasync::DispatchFn::newDispatchThread();
+		dt >> Job{std::unique_ptr<int>(new int(42)), &out, &replies, me};
+		while (replies < 1) yasync::haltAndDispatch();
+		yasync::DispatchFn route = dt >> yasync::newThread;
+		route >> Job{std::unique_ptr<int>(new int(43)), &out, &replies, me};
+		while (replies < 2) yasync::haltAndDispatch();
+		yasync::Checkpoint fin;
+		(dt >> yasync::thisThread) >> [&out, fin] {out << 44; fin();};
+		fin.dispatch();
+	};
+
 	tst.test("FastMutex", "400") >> [](std::ostream &out) {
 		unsigned int counter = 0;
 			yasync::FastMutex mx;
@@ -127,6 +224,48 @@ int main(int , char **) {
 		};
 		out << "," << (myid == hid) ? 1 : 0;
 	};
+	tst.test("Future.storedValue", "hello,hello,1") >> [](std::ostream &out) {
+		yasync::Future<std::string> f;
+		f.getPromise().setValue(std::string("hello"));
+		f >> [&](const std::string &x) {
+			out << x;
+		};
+		out << "," << f.get() << "," << (f.tryGetValue() == &f.get() ? 1 : 0);
+	};
+	tst.test("Future.observerOrder", "0123,0") >> [](std::ostream &out) {
+		class Obs : public yasync::AbstractPromiseObserver<int> {
+		public:
+			Obs(std::ostream &out) :out(out) {}
+			virtual void operator()(const int &) throw() { out << "X"; }
+			virtual void operator()(const std::exception_ptr &) throw() { out << "E"; }
+			std::ostream &out;
+		};
+		yasync::Future<int> f;
+		yasync::Promise<int> p = f.getPromise();
+		Obs obs(out);
+		for (int i = 0; i < 2; i++) f >> [&out, i](int) { out << i; };
+		f.addObserver(&obs);
+		for (int i = 2; i < 4; i++) f >> [&out, i](int) { out << i; };
+		f.removeObserver(&obs);
+		p.setValue(1);
+		out << "," << (f.removeObserver(&obs) ? 1 : 0);
+	};
+	tst.test("Future.removeObserverEmpty", "0,1,0") >> [](std::ostream &out) {
+		class Obs : public yasync::AbstractPromiseObserver<int> {
+		public:
+			virtual void operator()(const int &) throw() {}
+			virtual void operator()(const std::exception_ptr &) throw() {}
+		};
+		yasync::Future<int> f;
+		yasync::Promise<int> p = f.getPromise();
+		Obs obs;
+		//pending future without observers
+		out << (f.removeObserver(&obs) ? 1 : 0);
+		f.addObserver(&obs);
+		out << "," << (f.removeObserver(&obs) ? 1 : 0);
+		out << "," << (f.removeObserver(&obs) ? 1 : 0);
+		p.setValue(1);
+	};
 	tst.test("Future.inForeignThread", "42,1") >> [](std::ostream &out) {
 		yasync::Future<int> f = yasync::newThread >> [] {
 			yasync::sleep(100);
@@ -160,7 +299,284 @@ int main(int , char **) {
 		out << "," << (hid1 != hid2) ? 1 : 0;
 	};
 
+	tst.test("Future.fusedChain", "3,10,1") >> [](std::ostream &out) {
+		yasync::Future<int> f;
+		yasync::Promise<int> p = f.getPromise();
+		yasync::Future<std::string> r = f >> [](int x) {
+			return x + 1;
+		} >> [&out](int x) {
+			out << x << ",";
+			if (x == 3) throw std::runtime_error("fail");
+			return x;
+		} >> [](int x) {
+			return x * 2;
+		} >> [](std::exception_ptr) {
+			return 10;
+		} >> [](int x) {
+			return std::to_string(x);
+		};
+		yasync::Future<int> g = f >> [](int) {} >> [](std::exception_ptr) {};
+		p.setValue(2);
+		out << r.get() << "," << (g == f ? 1 : 0);
+	};
+	tst.test("Future.collapse", "100000") >> [](std::ostream &out) {
+		struct Rec {
+			std::vector<yasync::Future<int> > &fs;
+			Rec(std::vector<yasync::Future<int> > &fs) :fs(fs) {}
+			yasync::Future<int> step(std::size_t i) {
+				Rec me = *this;
+				return fs[i] >> [me, i](int x) {
+					if (i + 1 == me.fs.size()) return yasync::Future<int>(x);
+					return Rec(me).step(i + 1);
+				};
+			}
+		};
+		std::vector<yasync::Future<int> > fs(100000);
+		yasync::Future<int> r = Rec(fs).step(0);
+		for (std::size_t i = 0; i < fs.size(); i++) fs[i].getPromise().setValue((int)i + 1);
+		out << r.get();
+	};
+	tst.test("Future.linkCancel", "42,42,0,canceled") >> [](std::ostream &out) {
+		{
+			//canceling the outer future doesn't affect consumers of the inner future
+			yasync::Future<int> outer, inner;
+			yasync::Promise<int> pout = outer.getPromise(), pin = inner.getPromise();
+			yasync::Future<int> other = inner;
+			pout.setValue(inner);
+			outer.cancel();
+			pin.setValue(42);
+			out << other.get() << "," << inner.get() << ",";
+		}
+		{
+			//the linked future lost its promise, so the outer future is canceled
+			yasync::Future<int> outer, inner;
+			yasync::Promise<int> pout = outer.getPromise();
+			{
+				yasync::Promise<int> pin = inner.getPromise();
+				pout.setValue(std::move(inner));
+			}
+			out << outer.isPending() << ",";
+			try {
+				outer.get();
+			} catch (yasync::CanceledPromise &) {
+				out << "canceled";
+			}
+		}
+	};
+	tst.test("Future.asyncLoop", "100000,64") >> [](std::ostream &out) {
+		yasync::Future<int> sync = yasync::asyncLoop(0, [](int n) { return n < 100000; }, [](int n) {
+			return yasync::Future<int>(n + 1);
+		});
+		yasync::Future<int> async = yasync::asyncLoop(1, [](int n) { return n < 64; }, [](int n) {
+			return yasync::newThread >> [n] { return n * 2; };
+		});
+		out << sync.get() << "," << async.get();
+	};
+
 
+	tst.test("Future.eagerChain", "1,1,0,2,3,12,2:4") >> [](std::ostream &out) {
+		yasync::Future<int> f;
+		yasync::Promise<int> p = f.getPromise();
+		int seen = 0;
+		auto c = f >> [&seen](int x) {seen = x; return x * 2;};
+		out << c.isPending() << ",";
+		//stored chain is connected, the handler is called
+		p.setValue(1);
+		out << seen << "," << c.isPending() << "," << *c.tryGetValue() << ",";
+		//the handler already finished, so the next one is connected to the result
+		yasync::Future<int> d = std::move(c) >> [](int x) {return x + 1;};
+		out << d.get() << ",";
+		out << (yasync::Future<int>(5) >> [](int x) {return x + 1;} >> [](int x) {return x * 2;}).get() << ",";
+		//the intermediate result is visible to other variable, so it is not reused
+		yasync::Future<int> g;
+		auto e = g >> [](int x) {return x + 1;};
+		yasync::Future<int> mid = e;
+		yasync::Future<int> end = std::move(e) >> [](int x) {return x * 2;};
+		g.getPromise().setValue(1);
+		out << mid.get() << ":" << end.get();
+	};
+
+	tst.test("Future.canceled", "canceled,canceled,1") >> [](std::ostream &out) {
+		yasync::Future<int> f1, f2;
+		f1.getPromise();
+		f2.cancel();
+		for (auto f : { f1, f2 }) {
+			try {
+				f.get();
+			}
+			catch (const yasync::CanceledPromise &) {
+				out << "canceled,";
+			}
+		}
+		out << (f1.getException() == f2.getException() ? 1 : 0);
+	};
+	tst.test("Future.whenAll", "0,2,4,6,8,1") >> [](std::ostream &out) {
+		std::vector<yasync::Future<int> > fs(5);
+		std::vector<yasync::Promise<int> > ps;
+		for (auto &f : fs) ps.push_back(f.getPromise());
+		yasync::Future<std::vector<int> > all = yasync::whenAll(fs.begin(), fs.end());
+		yasync::Future<std::pair<std::size_t, int> > any = yasync::whenAny(fs.begin(), fs.end());
+		for (int i = 4; i >= 0; i--) {
+			yasync::Promise<int> p = ps[i];
+			yasync::newThread >> [p, i] { p.setValue(i * 2); };
+		}
+		for (int v : all.get()) out << v << ",";
+		std::pair<std::size_t, int> a = any.get();
+		out << (a.second == (int)a.first * 2 ? 1 : 0);
+	};
+
+	tst.test("Future.whenResolved", "0:5,1,5+7") >> [](std::ostream &out) {
+		//resolved future calls its slot during connecting, other slots are not attached yet
+		yasync::Future<int> pending;
+		yasync::Promise<int> p = pending.getPromise();
+		std::vector<yasync::Future<int> > fs = {yasync::Future<int>(5), pending};
+		yasync::Future<std::pair<std::size_t, int> > any = yasync::whenAny(fs.begin(), fs.end());
+		yasync::Future<std::vector<int> > all = yasync::whenAll(fs.begin(), fs.end());
+		std::pair<std::size_t, int> a = any.get();
+		out << a.first << ":" << a.second << "," << (all.tryGetValue() == nullptr ? 1 : 0) << ",";
+		p.setValue(7);
+		std::vector<int> v = all.get();
+		out << v[0] << "+" << v[1];
+	};
+
+	tst.test("Future.expected", "42,timeout,-1") >> [](std::ostream &out) {
+		typedef yasync::Expected<int> Result;
+		yasync::Future<Result> f1, f2;
+		f1.getPromise().setValue(Result(42));
+		f2.getPromise().setValue(yasync::makeUnexpected(std::make_error_code(std::errc::timed_out)));
+		for (auto f : { f1, f2 }) {
+			f >> [&out](const Result &r) {
+				if (r) out << r.value() << ",";
+				else if (r.error() == std::errc::timed_out) out << "timeout,";
+			};
+		}
+		out << f2.get().valueOr(-1);
+	};
+
+	tst.test("Future.moveOnly", "42,43,0") >> [](std::ostream &out) {
+		struct Counted {
+			int copies;
+			Counted() :copies(0) {}
+			Counted(const Counted &other) :copies(other.copies + 1) {}
+			Counted(Counted &&other) :copies(other.copies) {}
+		};
+		typedef std::unique_ptr<int> Ptr;
+		yasync::Future<Ptr> f1;
+		f1.getPromise().setValue(Ptr(new int(42)));
+		out << *f1.take() << ",";
+		yasync::Future<Ptr> f2;
+		yasync::Future<int> r2 = f2 >> yasync::newThread >> [](Ptr v) { return *v + 1; };
+		f2.getPromise().setValue(Ptr(new int(42)));
+		out << r2.get() << ",";
+		yasync::Promise<Counted> p;
+		yasync::Future<int> r3(nullptr);
+		{
+			yasync::Future<Counted> f3;
+			p = f3.getPromise();
+			r3 = f3 >> [](Counted c) { return c.copies; };
+		}
+		p.setValue(Counted());
+		out << r3.get();
+	};
+
+	tst.test("Future.newThreadMoveOnly", "42,43") >> [](std::ostream &out) {
+		//move-only callable which returns a value
+		struct Fn {
+			std::unique_ptr<int> u;
+			int operator()() {return *u;}
+		};
+		Fn fn;
+		fn.u.reset(new int(42));
+		yasync::Future<int> f = yasync::newThread >> std::move(fn);
+		out << f.get() << ",";
+		Fn fn2;
+		fn2.u.reset(new int(43));
+		yasync::Future<int> g = yasync::DispatchFn::newThread() >> std::move(fn2);
+		out << g.get();
+	};
+
+#ifdef __cpp_aligned_new
+	tst.test("Future.overAligned", "0,20") >> [](std::ostream &out) {
+		struct alignas(64) X {
+			int v;
+		};
+		std::vector<yasync::Future<X> > fs;
+		int misaligned = 0, sum = 0;
+		for (int i = 0; i < 20; i++) {
+			fs.push_back(yasync::Future<X>());
+			fs.back().getPromise().setValue(X{1});
+			const X &x = fs.back().get();
+			if (reinterpret_cast<std::uintptr_t>(&x) % alignof(X)) misaligned++;
+			sum += x.v;
+		}
+		out << misaligned << "," << sum;
+	};
+#endif
+
+#ifdef YASYNC_COROUTINES
+	tst.test("Future.coroutine", "42,7,1,8,boom,boom,void:5,pool:6") >> [](std::ostream &out) {
+		struct Fn {
+			static yasync::Task<int> inner(yasync::Future<int> f) {
+				int v = co_await f;
+				co_return v + 1;
+			}
+			static yasync::Task<int> outer(yasync::Future<int> f) {
+				co_await yasync::DispatchFn::newThread();
+				int v = co_await inner(f);
+				co_return v * 2;
+			}
+			static yasync::Task<int> plain(yasync::Future<int> f) {
+				co_return co_await f;
+			}
+			static yasync::Task<int> fail(yasync::Future<int> f, std::ostream *out) {
+				try {
+					co_await f;
+				} catch (std::exception &e) {
+					*out << e.what() << ",";
+				}
+				co_return co_await f;
+			}
+			static yasync::Task<> print(yasync::Future<int> f, std::ostream *out) {
+				*out << "void:" << co_await f << ",";
+			}
+			static yasync::Task<int> onPool(yasync::Future<int> f) {
+				co_return co_await f + 1;
+			}
+		};
+		yasync::Future<int> f;
+		yasync::Future<int> r = Fn::outer(f).start();
+		f.getPromise().setValue(20);
+		out << r.get() << ",";
+
+		//already resolved future
+		out << Fn::plain(yasync::Future<int>(7)).start().get() << ",";
+		//future which is resolving, its observers can't be added, so the coroutine continues by symmetric transfer
+		yasync::Future<int> g;
+		yasync::Future<int> h(nullptr);
+		g >> [&] {h = Fn::plain(g).start(); out << h.isResolved() << ",";};
+		g.getPromise().setValue(8);
+		out << h.get() << ",";
+
+		//exception is thrown from co_await and leaves the coroutine through its future
+		class Boom : public std::exception {
+		public:
+			const char *what() const throw() { return "boom"; }
+		};
+		yasync::Future<int> e = Fn::fail(yasync::Future<int>::exception(Boom()), &out).start();
+		try {
+			e.get();
+		} catch (Boom &) {
+			out << "boom,";
+		}
+
+		yasync::Future<yasync::Void> v = Fn::print(yasync::Future<int>(5), &out).start();
+		v.wait();
+
+		yasync::ThreadPool poolCfg;
+		yasync::Future<int> p = Fn::onPool(yasync::Future<int>(5)).start(poolCfg.start());
+		out << "pool:" << p.get();
+	};
+#endif
 
 	tst.test("Scheduler", "A:100, B:150, C:70, D:160") >> [](std::ostream &out) {
 		auto n = std::chrono::steady_clock::now();
@@ -251,6 +667,410 @@ int main(int , char **) {
 		out << hash.hash;
 	};
 
+	tst.test("Pool.batch", "10000,10000,0123") >> [](std::ostream &out) {
+		std::atomic<unsigned int> count(0);
+		yasync::ThreadPool poolCfg;
+		yasync::Checkpoint finish;
+		poolCfg.setFinalStop(finish).setMaxQueue(100000);
+		std::vector<std::function<void()> > batch;
+		for (int i = 0; i < 10000; i++) batch.push_back([&count] {count++;});
+		{
+			yasync::DispatchFn pool = poolCfg.start();
+			out << pool.dispatchBatch(batch) << ",";
+		}
+		finish.wait();
+		out << count << ",";
+		std::vector<std::function<void()> > ordered;
+		for (int i = 0; i < 4; i++) ordered.push_back([&out, i] {out << i;});
+		yasync::DispatchFn::thisThread().dispatchBatch(ordered);
+		yasync::dispatchAll(nullptr);
+	};
+
+	tst.test("Pool.workStealing", "32767,10000") >> [](std::ostream &out) {
+		struct Spawn {
+			static void run(std::atomic<unsigned int> &count, int depth) {
+				count++;
+				if (depth) for (int i = 0; i < 2; i++) {
+					yasync::thisThread >> [&count, depth] {run(count, depth - 1);};
+				}
+			}
+		};
+		std::atomic<unsigned int> count(0);
+		std::atomic<unsigned int> external(0);
+		yasync::ThreadPool poolCfg;
+		yasync::Checkpoint finish;
+		poolCfg.setFinalStop(finish).setWorkStealing(true).setMaxQueue(100);
+		std::vector<std::function<void()> > batch;
+		for (int i = 0; i < 10000; i++) batch.push_back([&external] {external++;});
+		{
+			yasync::DispatchFn pool = poolCfg.start();
+			pool >> [&count] {Spawn::run(count, 14);};
+			pool.dispatchBatch(batch);
+		}
+		finish.wait();
+		out << count << "," << external;
+	};
+
+	tst.test("Pool.overflow", "0A,B1A,1b,0A,0Ab1;0A,B1A,1b,0A,0Ab1") >> [](std::ostream &out) {
+		typedef yasync::ThreadPool TP;
+		TP::OverflowPolicy policies[] = {TP::reject, TP::callerRuns, TP::dropOldest, TP::block, TP::block};
+		std::uintptr_t me = yasync::thisThreadId();
+		for (int ws = 0; ws < 2; ws++) {
+			if (ws) out << ";";
+			for (int i = 0; i < 5; i++) {
+				if (i) out << ",";
+				yasync::Gate hold;
+				yasync::Checkpoint running, finish;
+				TP poolCfg;
+				poolCfg.setFinalStop(finish).setWorkStealing(ws != 0).setMaxThreads(1).setMaxQueue(1)
+					.setOverflowPolicy(policies[i]).setQueueTimeout(20).setIdleTimeout(100000);
+				yasync::Future<yasync::Void> f;
+				{
+					yasync::DispatchFn pool = poolCfg.start();
+					//block the worker and fill the queue
+					pool >> [&hold, running] {running(); hold.wait();};
+					running.wait();
+					pool >> [&out] {out << "A";};
+					auto b = [&out, me] {out << (yasync::thisThreadId() == me?"B":"b");};
+					if (i < 4) {
+						out << (pool >> b);
+					} else {
+						f = yasync::dispatchAsync(pool, b);
+						out << f.isResolved();
+					}
+					hold.open();
+				}
+				finish.wait();
+				if (i == 4) out << f.isResolved();
+			}
+		}
+	};
+
+	tst.test("Pool.dispatchAsyncRouted", "AC,1") >> [](std::ostream &out) {
+		//the pool receives the function in other thread, while the caller finishes dispatchAsync()
+		std::string order;
+		yasync::Gate hold;
+		yasync::Checkpoint running, finish;
+		yasync::ThreadPool poolCfg;
+		poolCfg.setFinalStop(finish).setMaxThreads(1).setMaxQueue(1);
+		yasync::Future<yasync::Void> f;
+		{
+			yasync::DispatchFn pool = poolCfg.start();
+			pool >> [&hold, running] {running(); hold.wait();};
+			running.wait();
+			pool >> [&order] {order.push_back('A');};
+			f = yasync::dispatchAsync(yasync::DispatchFn::newThread() >> pool, [&order] {order.push_back('C');});
+			hold.open();
+		}
+		finish.wait();
+		out << order << "," << f.isResolved();
+	};
+
+	tst.test("Pool.minThreads", "3,0,3;3,0,3") >> [](std::ostream &out) {
+		for (int ws = 0; ws < 2; ws++) {
+			std::atomic<unsigned int> started(0), stopped(0);
+			yasync::ThreadPool poolCfg;
+			yasync::Checkpoint finish;
+			poolCfg.setFinalStop(finish).setWorkStealing(ws != 0)
+				.setMinThreads(3).setMaxThreads(4).setWaitForMinThreads(true).setIdleTimeout(1)
+				.setThreadStart(yasync::AlertFn::callFn([&started](const std::uintptr_t *) {started++;}))
+				.setThreadStop(yasync::AlertFn::callFn([&stopped](const std::uintptr_t *) {stopped++;}));
+			{
+				yasync::DispatchFn pool = poolCfg.start();
+				out << (ws?";":"") << started << ",";
+				//idle timeout doesn't stop these threads
+				yasync::sleep(50);
+				out << stopped << ",";
+			}
+			finish.wait();
+			out << stopped;
+		}
+	};
+
+	tst.test("Pool.elastic", "4,3") >> [](std::ostream &out) {
+		std::atomic<unsigned int> started(0), stopped(0);
+		yasync::ThreadPool poolCfg;
+		yasync::Checkpoint finish;
+		poolCfg.setFinalStop(finish).setMaxThreads(4).setMaxQueue(1000).setIdleTimeout(100000)
+			.setTargetQueueLatency(1000)
+			.setThreadStart(yasync::AlertFn::callFn([&started](const std::uintptr_t *) {started++;}))
+			.setThreadStop(yasync::AlertFn::callFn([&stopped](const std::uintptr_t *) {stopped++;}));
+		{
+			yasync::DispatchFn pool = poolCfg.start();
+			//tasks wait in the queue, the pool grows
+			for (int i = 0; i < 256; i++) {
+				pool >> [] {yasync::sleep(2);};
+			}
+			//tasks don't wait, the pool shrinks
+			for (int i = 0; i < 512; i++) {
+				yasync::Checkpoint done;
+				pool >> [done] {done();};
+				done.wait();
+			}
+			yasync::sleep(100);
+			out << started << "," << stopped;
+		}
+		finish.wait();
+	};
+
+	tst.test("Dispatch.priority", "10,3:HHHHHHHLHHHLL;2,1:HHL") >> [](std::ostream &out) {
+		std::string order;
+		yasync::Checkpoint finish, started;
+		yasync::Gate hold;
+		{
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(1).setMaxQueue(100);
+			yasync::DispatchFn pool = poolCfg.start();
+			//block the only worker, so the functions wait in the queue
+			pool >> [started, &hold] {started(); hold.wait();};
+			started.wait();
+			yasync::DispatchFn low = pool.withPriority(yasync::lowPriority);
+			yasync::DispatchFn high = pool.withPriority(yasync::highPriority);
+			for (int i = 0; i < 3; i++) low >> [&order] {order.push_back('L');};
+			for (int i = 0; i < 10; i++) high >> [&order] {order.push_back('H');};
+			out << pool.getQueueDepth(yasync::highPriority) << "," << pool.getQueueDepth(yasync::lowPriority) << ":";
+			hold.open();
+		}
+		finish.wait();
+		out << order << ";";
+		order.clear();
+		yasync::DispatchFn me = yasync::DispatchFn::thisThread();
+		me.withPriority(yasync::lowPriority) >> [&order] {order.push_back('L');};
+		me.withPriority(yasync::highPriority) >> [&order] {order.push_back('H');};
+		me.withPriority(yasync::highPriority) >> [&order] {order.push_back('H');};
+		out << me.getQueueDepth(yasync::highPriority) << "," << me.getQueueDepth(yasync::lowPriority) << ":";
+		yasync::dispatchAll(yasync::Timeout::now());
+		//consume the alert left by dispatching
+		yasync::sleep(yasync::Timeout::now());
+		out << order;
+	};
+
+	tst.test("Pool.deadline", "EBAC,late;late") >> [](std::ostream &out) {
+		std::string order;
+		yasync::Checkpoint finish, started;
+		yasync::Gate hold;
+		yasync::Future<int> f;
+		{
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(1).setMaxQueue(100).setEarliestDeadlineFirst(true);
+			yasync::DispatchFn pool = poolCfg.start();
+			//block the only worker, so the functions wait in the queue
+			pool >> [started, &hold] {started(); hold.wait();};
+			started.wait();
+			pool.withDeadline(10000) >> [&order] {order.push_back('A');};
+			pool.withDeadline(5000) >> [&order] {order.push_back('B');};
+			pool >> [&order] {order.push_back('C');};
+			yasync::Timeout late(20);
+			f = pool.withDeadline(late) >> [&order] {order.push_back('D'); return 1;};
+			pool.withDeadline(3000) >> [&order] {order.push_back('E');};
+			//sleeping can be interrupted by an alert
+			while (!late) yasync::sleep(late);
+			hold.open();
+		}
+		finish.wait();
+		out << order << ",";
+		try {
+			f.get();
+		} catch (const yasync::DeadlineExceeded &) {
+			out << "late;";
+		}
+		//late function is dropped by any dispatcher
+		yasync::Future<int> g = yasync::DispatchFn::thisThread().withDeadline(yasync::Timeout::now()) >> [] {return 1;};
+		yasync::dispatchAll(yasync::Timeout::now());
+		//consume the alert left by dispatching
+		yasync::sleep(yasync::Timeout::now());
+		try {
+			g.get();
+		} catch (const yasync::DeadlineExceeded &) {
+			out << "late";
+		}
+	};
+
+	tst.test("Dispatch.strand", "16000,1,1") >> [](std::ostream &out) {
+		static const unsigned int keys = 16, perKey = 1000;
+		std::vector<unsigned int> next(keys, 0);
+		std::vector<std::atomic<bool> > busy(keys);
+		std::atomic<unsigned int> count(0);
+		std::atomic<bool> ordered(true), serial(true);
+		yasync::Checkpoint finish, done;
+		{
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(4).setMaxQueue(100000);
+			yasync::KeyedExecutor exec(poolCfg.start(), 8);
+			for (unsigned int i = 0; i < perKey; i++) {
+				for (unsigned int k = 0; k < keys; k++) {
+					exec[k] >> [&, i, k]() mutable {
+						if (busy[k].exchange(true)) serial = false;
+						if (next[k]++ != i) ordered = false;
+						busy[k] = false;
+						if (++count == keys * perKey) done();
+					};
+				}
+			}
+			done.wait();
+		}
+		finish.wait();
+		out << count << "," << ordered << "," << serial;
+	};
+
+	tst.test("Pool.helpWhileWaiting", "3,42;3,42") >> [](std::ostream &out) {
+		for (int ws = 0; ws < 2; ws++) {
+			if (ws) out << ";";
+			yasync::ThreadPool poolCfg;
+			yasync::Checkpoint finish;
+			poolCfg.setFinalStop(finish).setWorkStealing(ws != 0).setMaxThreads(1).setMaxQueue(100);
+			{
+				yasync::DispatchFn pool = poolCfg.start();
+				//the only worker waits for functions of the same pool
+				yasync::Future<int> r = pool >> [] {
+					yasync::Future<int> b = yasync::thisThread >> [] {
+						yasync::Future<int> c = yasync::thisThread >> [] {return 1;};
+						return c.get() + 1;
+					};
+					return b.get() + 1;
+				};
+				out << r.get() << ",";
+				//the waiting worker is woken by the new function
+				yasync::Future<int> f;
+				yasync::Promise<int> p = f.getPromise();
+				r = pool >> [f] {return f.get() + 1;};
+				yasync::sleep(10);
+				pool >> [p]() mutable {p.setValue(41);};
+				out << r.get();
+			}
+			finish.wait();
+		}
+	};
+
+	tst.test("Pool.spin", "1000") >> [](std::ostream &out) {
+		std::atomic<unsigned int> count(0);
+		yasync::ThreadPool poolCfg;
+		yasync::Checkpoint finish;
+		poolCfg.setFinalStop(finish).setSpinTime(100);
+		yasync::setThreadSpinTime(100);
+		{
+			yasync::DispatchFn pool = poolCfg.start();
+			//ping-pong, both sides spin while waiting for each other
+			for (int i = 0; i < 1000; i++) {
+				yasync::Checkpoint done;
+				pool >> [&count, done] {count++; done();};
+				done.wait();
+			}
+		}
+		finish.wait();
+		yasync::setThreadSpinTime(0);
+		out << count;
+	};
+
+	tst.test("Pool.lifoSlot", "CAB,123X456") >> [](std::ostream &out) {
+		struct Chain {
+			static void run(std::ostream &out, int n) {
+				out << n;
+				if (n < 6) yasync::thisThread >> [&out, n] {run(out, n + 1);};
+			}
+		};
+		yasync::ThreadPool poolCfg;
+		//the queue holds functions displaced from the slot
+		poolCfg.setMaxThreads(1).setMaxQueue(10).setLifoSlot(true);
+		std::function<void()> phases[2] = {
+			[&out] {
+				//the last dispatched function runs first
+				yasync::thisThread >> [&out] {out << "A";};
+				yasync::thisThread >> [&out] {out << "B";};
+				yasync::thisThread >> [&out] {out << "C";};
+			},
+			[&out] {
+				//streak is limited, the queued function runs after the third continuation
+				yasync::thisThread >> [&out] {out << "X";};
+				yasync::thisThread >> [&out] {Chain::run(out, 1);};
+			}
+		};
+		for (int i = 0; i < 2; i++) {
+			yasync::Checkpoint finish;
+			poolCfg.setFinalStop(finish);
+			if (i) out << ",";
+			poolCfg.start() >> phases[i];
+			finish.wait();
+		}
+	};
+
+	tst.test("Pool.lifoSlotBlocked", "run,CQQQ") >> [](std::ostream &out) {
+		{
+			//idle worker runs the continuation while the owner blocks
+			yasync::Checkpoint finish;
+			yasync::Gate done;
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(4).setLifoSlot(true);
+			poolCfg.start() >> [&out, &done] {
+				yasync::thisThread >> [&done] {done.open();};
+				out << (done.wait(yasync::Timeout(2000))?"run":"stuck");
+			};
+			finish.wait();
+		}
+		out << ",";
+		{
+			//all workers are busy, the function left in the slot is taken before the queue
+			std::string order;
+			yasync::Checkpoint finish, busy, owner;
+			yasync::Gate hold, done;
+			{
+				yasync::ThreadPool poolCfg;
+				poolCfg.setFinalStop(finish).setMaxThreads(2).setMaxQueue(100).setLifoSlot(true);
+				yasync::DispatchFn pool = poolCfg.start();
+				pool >> [busy, &hold] {busy(); hold.wait();};
+				busy.wait();
+				pool >> [owner, &order, &done] {
+					yasync::thisThread >> [&order, &done] {order.push_back('C'); done.open();};
+					owner();
+					if (!done.wait(yasync::Timeout(2000))) order.push_back('X');
+				};
+				owner.wait();
+				for (int i = 0; i < 3; i++) pool >> [&order] {order.push_back('Q');};
+				yasync::Timeout tm(5);
+				while (!tm) yasync::sleep(tm);
+				hold.open();
+			}
+			finish.wait();
+			out << order;
+		}
+	};
+
+	tst.test("Pool.lifoSlotLimit", "110,BA") >> [](std::ostream &out) {
+		std::string order;
+		yasync::Checkpoint finish;
+		{
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(1).setMaxQueue(1).setLifoSlot(true)
+				.setOverflowPolicy(yasync::ThreadPool::reject);
+			poolCfg.start() >> [&out, &order] {
+				yasync::DispatchFn me = yasync::DispatchFn::thisThread();
+				//A goes to the slot, B displaces A to the queue, the full queue rejects C
+				out << (me >> [&order] {order.push_back('A');});
+				out << (me >> [&order] {order.push_back('B');});
+				out << (me >> [&order] {order.push_back('C');});
+			};
+		}
+		finish.wait();
+		out << "," << order;
+	};
+
+	tst.test("Pool.stalledQueue", "run") >> [](std::ostream &out) {
+		yasync::Checkpoint finish, started;
+		yasync::Gate hold, done;
+		{
+			yasync::ThreadPool poolCfg;
+			poolCfg.setFinalStop(finish).setMaxThreads(4).setMaxQueue(100).setTargetQueueLatency(1000);
+			yasync::DispatchFn pool = poolCfg.start();
+			//the only worker blocks, no latency is sampled, the stalled queue must start a thread
+			pool >> [started, &hold] {started(); hold.wait();};
+			started.wait();
+			pool >> [&done] {done.open();};
+			out << (done.wait(yasync::Timeout(2000))?"run":"stuck");
+			hold.open();
+		}
+		finish.wait();
+	};
+
 
 	return tst.didFail()?1:0;
 }
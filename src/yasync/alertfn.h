@@ -142,6 +142,18 @@ function is equivalent to sleep(nullptr) but contains less code.
 */
 std::uintptr_t halt();
 
+///Sets spin time of the current thread
+/**
+ * Before the thread is parked in sleep() or halt(), it spins a while waiting for an alert. This
+ * saves a system call and a context switch when the alert comes soon.
+ * The spinning is adaptive, it becomes shorter when alerts don't come during spinning.
+ *
+ * @param us spin time in microseconds. Default is 0, which disables spinning
+ *
+ * @note Threads of thread pools set spin time from ThreadPool::setSpinTime().
+ */
+void setThreadSpinTime(unsigned int us);
+
 
 ///Returns this thread identificator
 /**
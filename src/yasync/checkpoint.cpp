@@ -1,5 +1,6 @@
 #include "checkpoint.h"
 #include "dispatcher.h"
+#include "timeout.h"
 
 namespace yasync {
 
@@ -24,14 +25,14 @@ namespace yasync {
 	void Checkpoint::dispatch()
 	{
 		while (!get().isSignaled()) {
-			haltAndDispatch();
+			dispatchAll(nullptr);
 		}
 	}
 
 	bool Checkpoint::dispatch(const Timeout & tm)
 	{
 		while (!get().isSignaled()) {
-			if (sleepAndDispatch(tm)) return false;
+			if (dispatchAll(tm) == 0 && tm) return false;
 		}
 		return true;
 	}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include "alertfn.h"
 
 namespace yasync {
@@ -38,9 +39,9 @@ namespace yasync {
 			AlertMonitor(const AlertFn &fwd) :fwd(fwd),signaled(false), reason(0) {}
 
 			virtual void wakeUp(const std::uintptr_t *reason = nullptr) throw() {
-				signaled = true;
+				if (reason) this->reason = *reason;
+				signaled.store(true, std::memory_order_release);
 				if (reason) {
-					this->reason = *reason;
 					fwd(*reason);
 				}
 				else {
@@ -48,7 +49,7 @@ namespace yasync {
 				}
 			}
 
-			bool isSignaled() const { return signaled; }
+			bool isSignaled() const { return signaled.load(std::memory_order_acquire); }
 			std::uintptr_t getReason() const { return reason; }
 			void reset() {
 				signaled = false;
@@ -58,7 +59,7 @@ namespace yasync {
 
 		protected:
 			AlertFn fwd;
-			bool signaled;
+			std::atomic<bool> signaled;
 			std::uintptr_t reason;
 		};
 
@@ -104,6 +105,8 @@ namespace yasync {
 		bool wait(const Timeout &tm);
 
 		///Dispatch functions while thread waiting for alert
+		/** Functions are processed in batches, see dispatchAll(). The checkpoint is tested
+		after each batch */
 		void dispatch();
 
 		///Dispatch functions while thread waiting for alert, you can specify a timeout
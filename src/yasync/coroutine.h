@@ -0,0 +1,242 @@
+#pragma once
+
+///Support for C++20 coroutines
+/** Header is empty when the compiler doesn't support coroutines, so it is safe to include it
+ * in a C++11 project.
+ *
+ * - any Future<T> can be awaited by co_await inside of a coroutine
+ * - co_await on DispatchFn moves execution of the coroutine to the dispatcher
+ * - Task<T> is lazy coroutine, which starts when it is awaited or started by Task::start()
+ *
+ * @code
+ * yasync::Task<int> calc(yasync::DispatchFn pool, yasync::Future<int> arg) {
+ *     co_await pool;          //continue in the pool
+ *     int v = co_await arg;   //wait for the argument without blocking the thread
+ *     co_return v * 2;
+ * }
+ *
+ * yasync::Future<int> res = calc(pool, arg).start();
+ * @endcode
+ */
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define YASYNC_COROUTINES 1
+#endif
+#endif
+
+#ifdef YASYNC_COROUTINES
+
+#include <coroutine>
+#include "future.h"
+
+namespace yasync {
+
+	namespace _hlp {
+
+		///Awaiter which suspends the coroutine until the future is resolved
+		template<typename T>
+		class FutureAwaiter : public AbstractPromiseObserver<T> {
+		public:
+			FutureAwaiter(const Future<T> &f) :f(f) {}
+
+			bool await_ready() const {
+				return f.isResolved();
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) {
+				this->h = h;
+				//when the future has been resolved meanwhile, continue by symmetric transfer
+				if (f.addObserverIfPending(this)) return std::noop_coroutine();
+				else return h;
+			}
+
+			T await_resume() const {
+				return PassValue<T>::pass(f.get());
+			}
+
+			virtual void operator()(const T &) throw() {
+				h.resume();
+			}
+			virtual void operator()(const std::exception_ptr &) throw() {
+				h.resume();
+			}
+
+		protected:
+			Future<T> f;
+			std::coroutine_handle<> h;
+		};
+
+		///Awaiter which resumes the coroutine through the dispatcher
+		class DispatchAwaiter {
+		public:
+			DispatchAwaiter(const DispatchFn &d) :d(d) {}
+
+			bool await_ready() const { return false; }
+
+			bool await_suspend(std::coroutine_handle<> h) {
+				//if the dispatcher rejects the function, the coroutine continues in current thread
+				return d >> [h] { h.resume(); };
+			}
+
+			void await_resume() const {}
+
+		protected:
+			DispatchFn d;
+		};
+
+		template<typename T>
+		class TaskPromiseBase {
+		public:
+			void return_value(const T &v) { resolver.setValue(v); }
+			void return_value(T &&v) { resolver.setValue(std::move(v)); }
+		protected:
+			Future<T> result;
+			Promise<T> resolver = result.getPromise();
+		};
+
+		template<>
+		class TaskPromiseBase<void> {
+		public:
+			void return_void() { resolver.setValue(Void()); }
+		protected:
+			Future<Void> result;
+			Promise<Void> resolver = result.getPromise();
+		};
+
+	}
+
+	template<typename T>
+	_hlp::FutureAwaiter<T> operator co_await(const Future<T> &f) {
+		return _hlp::FutureAwaiter<T>(f);
+	}
+
+	inline _hlp::DispatchAwaiter operator co_await(const DispatchFn &d) {
+		return _hlp::DispatchAwaiter(d);
+	}
+
+
+	///Lazy coroutine
+	/** The coroutine is not running until it is awaited (co_await) or started by the function start().
+	 * Result of the coroutine is carried by the Future. For Task<void> the type of the future is Future<Void>.
+	 *
+	 * The Task object owns the coroutine until it is started. Destroying the Task which has not been
+	 * started destroys the coroutine, so its future is resolved by CanceledPromise
+	 */
+	template<typename T = void>
+	class Task {
+	public:
+
+		typedef typename std::conditional<std::is_void<T>::value, Void, T>::type Type;
+
+		class promise_type : public _hlp::TaskPromiseBase<T> {
+		public:
+
+			Task get_return_object() {
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_always initial_suspend() noexcept { return {}; }
+
+			class FinalAwaiter {
+			public:
+				bool await_ready() const noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+					promise_type &p = h.promise();
+					if (p.continuation) return p.continuation;
+					if (p.detached) h.destroy();
+					return std::noop_coroutine();
+				}
+				void await_resume() const noexcept {}
+			};
+
+			FinalAwaiter final_suspend() noexcept { return {}; }
+
+			void unhandled_exception() {
+				this->resolver.setException(std::current_exception());
+			}
+
+		protected:
+			std::coroutine_handle<> continuation;
+			bool detached = false;
+			friend class Task;
+		};
+
+		typedef std::coroutine_handle<promise_type> Handle;
+
+		Task(Task &&other) :h(other.h) { other.h = nullptr; }
+		Task(const Task &other) = delete;
+		Task &operator=(const Task &other) = delete;
+		Task &operator=(Task &&other) {
+			if (this != &other) {
+				if (h) h.destroy();
+				h = other.h;
+				other.h = nullptr;
+			}
+			return *this;
+		}
+		~Task() {
+			if (h) h.destroy();
+		}
+
+		///Starts the coroutine in current thread
+		/**
+		 * @return future resolved by the result of the coroutine. The coroutine runs in
+		 * current thread until it is suspended for the first time. The Task object can be
+		 * destroyed after the start, the coroutine is destroyed once it finishes.
+		 */
+		Future<Type> start() {
+			Handle x = detach();
+			Future<Type> f = x.promise().result;
+			x.resume();
+			return f;
+		}
+
+		///Starts the coroutine through the dispatcher
+		/**
+		 * @param d dispatcher, for example DispatchFn returned by ThreadPool::start()
+		 * @return future resolved by the result of the coroutine. If the dispatcher rejects the
+		 * coroutine, it is destroyed and the future is resolved by CanceledPromise
+		 */
+		Future<Type> start(const DispatchFn &d) {
+			Handle x = detach();
+			Future<Type> f = x.promise().result;
+			if (!(d >> [x] { x.resume(); })) x.destroy();
+			return f;
+		}
+
+		///Awaiting the task starts it, the awaiting coroutine is resumed once the task finishes
+		class Awaiter {
+		public:
+			Awaiter(Handle h) :h(h) {}
+			bool await_ready() const { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) {
+				h.promise().continuation = cont;
+				return h;
+			}
+			Type await_resume() const {
+				return h.promise().result.get();
+			}
+		protected:
+			Handle h;
+		};
+
+		Awaiter operator co_await() const {
+			return Awaiter(h);
+		}
+
+	protected:
+		Handle h;
+
+		explicit Task(Handle h) :h(h) {}
+
+		Handle detach() {
+			Handle x = h;
+			h = nullptr;
+			x.promise().detached = true;
+			return x;
+		}
+	};
+
+}
+
+#endif
@@ -8,30 +8,32 @@
 
 #include "dispatcher.h"
 
-#include "lockScope.h"
-#include <deque>
-
-#include "fastmutex.h"
+#include "dispatchqueue.h"
+#include "timeout.h"
 #include "pool.h"
+#include "threadcache.h"
 namespace yasync {
 
 class Dispatcher: public AbstractDispatcher {
 public:
 
-	Dispatcher(const AlertFn &alert):alert(alert),opened(true) {}
+	Dispatcher(const AlertFn &alert):alert(alert) {}
 	virtual bool dispatch(const Fn &fn) throw();
+	virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw();
 	virtual bool sleep(const Timeout &tm, std::uintptr_t *reason);
 	virtual bool yield() throw();
 	virtual std::uintptr_t halt();
+	std::size_t dispatchAll(const Timeout &tm, std::size_t maxItems, unsigned int maxTime, std::uintptr_t *reason);
+	virtual std::size_t getQueueDepth(Priority priority) throw() {
+		return fnqueue.getDepth(priority);
+	}
 
 
 	void close();
 
 protected:
-	FastMutex lk;
 	AlertFn alert;
-	std::deque<Fn> fnqueue;
-	bool opened;
+	DispatchQueue fnqueue;
 
 };
 
@@ -70,6 +72,125 @@ DispatchFn DispatchFn::thisThread() {
 }
 
 
+///Task which is currently routed by this thread
+static thread_local AbstractDispatchedFunction *routeOwner = nullptr;
+
+struct AbstractDispatchedFunction::RouteHop: public PoolAlloc {
+	DispatchFn target;
+	RouteHop *next;
+
+	RouteHop(const DispatchFn &target, RouteHop *next):target(target),next(next) {}
+};
+
+namespace {
+
+	///Marks the task as routed by the current thread
+	class RouteOwnerScope {
+	public:
+		RouteOwnerScope(AbstractDispatchedFunction *fn):save(routeOwner) {routeOwner = fn;}
+		~RouteOwnerScope() {routeOwner = save;}
+	protected:
+		AbstractDispatchedFunction *save;
+	};
+
+	///Wraps the task which is already routed by other thread
+	class RoutedRef : public AbstractDispatchedFunction {
+	public:
+		RoutedRef(const AbstractDispatcher::Fn &fn) :fn(fn) {
+			priority = fn->getPriority();
+			deadline = fn->getDeadline();
+		}
+		virtual void run() throw() {
+			fn->run();
+		}
+		virtual void expired() throw() {
+			fn->expired();
+		}
+	protected:
+		AbstractDispatcher::Fn fn;
+	};
+
+}
+
+AbstractDispatchedFunction::~AbstractDispatchedFunction() {
+	clearRoute();
+}
+
+void AbstractDispatchedFunction::clearRoute() throw() {
+	while (route) {
+		RouteHop *h = route;
+		route = h->next;
+		delete h;
+	}
+}
+
+AbstractDispatcher::Fn AbstractDispatchedFunction::prepare(const AbstractDispatcher::Fn &fn) {
+	AbstractDispatchedFunction *p = fn;
+	if (p != nullptr && p != routeOwner && p->routed.load(std::memory_order_acquire)) {
+		return new RoutedRef(fn);
+	}
+	return fn;
+}
+
+void AbstractDispatchedFunction::moveRouteTo(AbstractDispatchedFunction &other) throw() {
+	//only the thread which carries the task through the route can move it
+	if (routeOwner == this) {
+		other.route = route;
+		other.routed.store(route != nullptr, std::memory_order_release);
+		route = nullptr;
+		routed.store(false, std::memory_order_release);
+	}
+}
+
+bool AbstractDispatchedFunction::dispatchRouted(const DispatchFn &first, const DispatchFn &next, const AbstractDispatcher::Fn &fn) throw() {
+	AbstractDispatcher::Fn task = fn;
+	AbstractDispatchedFunction *p = fn;
+	//route of the task is claimed, unless this thread already owns it
+	if (p != routeOwner && p->routed.exchange(true, std::memory_order_acquire)) {
+		task = new RoutedRef(fn);
+		task->routed.store(true, std::memory_order_relaxed);
+	}
+	task->route = new RouteHop(next, task->route);
+	bool res;
+	{
+		RouteOwnerScope _(task);
+		res = first >> task;
+	}
+	if (!res) {
+		//dispatcher rejected the task, so it is still owned by this thread
+		RouteHop *h = task->route;
+		task->route = h->next;
+		delete h;
+		if (task->route == nullptr) task->routed.store(false, std::memory_order_release);
+	}
+	return res;
+}
+
+void AbstractDispatchedFunction::execute() throw() {
+	//late task is dropped, it is not routed further
+	if (!deadline.isInfinite() && deadline) {
+		clearRoute();
+		routed.store(false, std::memory_order_release);
+		expired();
+		return;
+	}
+	while (route) {
+		RouteHop *h = route;
+		route = h->next;
+		DispatchFn target = h->target;
+		delete h;
+		bool res;
+		{
+			RouteOwnerScope _(this);
+			res = target >> AbstractDispatcher::Fn(this);
+		}
+		//once dispatched, the task can be already running elsewhere
+		if (res) return;
+	}
+	routed.store(false, std::memory_order_release);
+	run();
+}
+
 bool sleepAndDispatch(const Timeout& tm, std::uintptr_t* reason) {
 	return getCurrentDispatcher()->sleep(tm,reason);
 }
@@ -78,78 +199,89 @@ std::uintptr_t haltAndDispatch() {
 	return getCurrentDispatcher()->halt();
 }
 
+std::size_t dispatchAll(const Timeout& tm, std::size_t maxItems, unsigned int maxTime, std::uintptr_t* reason) {
+	return getCurrentDispatcher()->dispatchAll(tm, maxItems, maxTime, reason);
+}
+
 
 bool Dispatcher::dispatch(const Fn& fn) throw () {
-	LockScope<FastMutex> _(lk);
-	if (!opened) return false;
-	bool e = fnqueue.empty();
-	fnqueue.push_front(fn);
-	if (e) {
+	switch (fnqueue.push(fn)) {
+	case DispatchQueue::rejected:
+		return false;
+	case DispatchQueue::queuedFirst:
+		alert();
+		return true;
+	default:
+		return true;
+	}
+}
+
+std::size_t Dispatcher::dispatchMany(const Fn *fns, std::size_t count) throw () {
+	switch (fnqueue.push(fns, count)) {
+	case DispatchQueue::rejected:
+		return 0;
+	case DispatchQueue::queuedFirst:
 		alert();
+		return count;
+	default:
+		return count;
 	}
-	return true;
 }
 
 bool Dispatcher::sleep(const Timeout& tm, std::uintptr_t* reason) {
-	lk.lock();
-	if (fnqueue.empty()) {
-		lk.unlock();
+	Fn fn = fnqueue.pop();
+	if (fn == nullptr) {
 		if (::yasync::sleep(tm,reason)) return true;
-		lk.lock();
-	}
-	if (!fnqueue.empty()) {
-		Fn fn = fnqueue.front();
-		fnqueue.pop_back();
-		lk.unlock();
-		fn->run();
-	} else {
-		lk.unlock();
+		fn = fnqueue.pop();
 	}
+	if (fn != nullptr) fn->execute();
 	return false;
 
 }
 
 bool Dispatcher::yield() throw()
 {
-	lk.lock();
-	if (!fnqueue.empty()) {
-		Fn fn = fnqueue.front();
-		fnqueue.pop_back();
-		lk.unlock();
-		fn->run();
+	Fn fn = fnqueue.pop();
+	if (fn != nullptr) {
+		fn->execute();
 		return true;
 	}
 	else {
-		lk.unlock();
 		return false;
 	}
 }
 
 std::uintptr_t Dispatcher::halt() {
 	std::uintptr_t reason = 0;
-	lk.lock();
-	if (fnqueue.empty()) {
-		lk.unlock();
+	Fn fn = fnqueue.pop();
+	if (fn == nullptr) {
 		reason = ::yasync::halt();
-		lk.lock();
-	}
-	if (!fnqueue.empty()) {
-		Fn fn = fnqueue.front();
-		fnqueue.pop_back();
-		lk.unlock();
-		fn->run();
-	} else {
-		lk.unlock();
+		fn = fnqueue.pop();
 	}
+	if (fn != nullptr) fn->execute();
 	return reason;
 }
 
-void Dispatcher::close() {
-	LockScope<FastMutex> _(lk);
-	opened = false;
-	fnqueue.clear();
-
+std::size_t Dispatcher::dispatchAll(const Timeout& tm, std::size_t maxItems, unsigned int maxTime, std::uintptr_t* reason) {
+	Fn fn = fnqueue.pop();
+	if (fn == nullptr) {
+		if (::yasync::sleep(tm,reason)) return 0;
+		fn = fnqueue.pop();
+		if (fn == nullptr) return 0;
+	}
+	Timeout budget = maxTime == 0?Timeout(nullptr):Timeout(maxTime);
+	std::size_t count = 0;
+	do {
+		fn->execute();
+		count++;
+		if (count == maxItems || (maxTime && budget)) break;
+		fn = fnqueue.pop();
+	} while (fn != nullptr);
+	return count;
+}
 
+void Dispatcher::close() {
+	fnqueue.close();
 }
 
 AlertFn operator >> (DispatchFn  dispatcher, AlertFn target)
@@ -178,9 +310,7 @@ public:
 	}
 
 	virtual bool dispatch(const Fn &fn) throw() {
-		newThread >> [fn] {
-			fn->run();
-		};
+		if (fn != nullptr) ThreadCache::run(fn);
 		return true;
 	}
 
@@ -191,6 +321,76 @@ DispatchFn DispatchFn::newThread() {
 	return DispatchFn(static_cast<AbstractDispatcher *>(&dispatch));
 }
 
+///Count of functions processed by the strand before it is scheduled again
+static const std::size_t strandBatch = 64;
+
+class Strand : public AbstractDispatcher {
+public:
+	Strand(DispatchFn underlying):underlying(underlying),scheduled(false) {}
+
+	virtual bool dispatch(const Fn &fn) throw () {
+		switch (queue.push(fn)) {
+		case DispatchQueue::rejected:
+			return false;
+		default:
+			return schedule();
+		}
+	}
+
+	virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw () {
+		switch (queue.push(fns, count)) {
+		case DispatchQueue::rejected:
+			return 0;
+		default:
+			return schedule()?count:0;
+		}
+	}
+
+	virtual std::size_t getQueueDepth(Priority priority) throw () {
+		return queue.getDepth(priority);
+	}
+
+protected:
+	DispatchFn underlying;
+	DispatchQueue queue;
+	///True, while the strand is scheduled or running (the owner is the consumer of the queue)
+	std::atomic<bool> scheduled;
+
+	bool schedule() {
+		if (scheduled.exchange(true, std::memory_order_acq_rel)) return true;
+		RefCntPtr<Strand> me(this);
+		if (underlying >> [me] {me->drain();}) return true;
+		//underlying dispatcher is gone, the strand stays scheduled and closed
+		queue.close();
+		return false;
+	}
+
+	void drain() {
+		do {
+			std::size_t count = 0;
+			Fn fn = queue.pop();
+			while (fn != nullptr) {
+				fn->execute();
+				fn = nullptr;
+				if (++count == strandBatch) {
+					//continue by next batch, if the underlying dispatcher accepts it
+					RefCntPtr<Strand> me(this);
+					if (underlying >> [me] {me->drain();}) return;
+					count = 0;
+				}
+				fn = queue.pop();
+			}
+			//release the queue, then check for functions pushed meanwhile
+			scheduled.exchange(false, std::memory_order_acq_rel);
+		} while (queue.hasPending() && !scheduled.exchange(true, std::memory_order_acq_rel));
+	}
+};
+
+DispatchFn DispatchFn::strand(DispatchFn underlying) {
+	RefCntPtr<AbstractDispatcher> d(new Strand(underlying));
+	return d;
+}
+
 DispatchFn DispatchFn::newDispatchThread()
 {
 	ThreadPool pool;
@@ -207,18 +407,43 @@ public:
 		:first(first), second(second) {}
 
 	virtual bool dispatch(const Fn &fn) throw () {
+		if (fn == nullptr) {
+			//empty function is a command for the second dispatcher
+			DispatchFn s = second;
+			return first >> [s] {
+				s >> Fn();
+			};
+		}
+		return AbstractDispatchedFunction::dispatchRouted(first, second, fn);
+	}
 
-		DispatchFn s = second;		
-		return first >> [s,fn] {
-			if (!(s >> fn)) {
-				if (fn != nullptr) fn->run();
-			}
-		};
+	virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw () {
+
+		//whole batch is routed through the first dispatcher as single function
+		return (first >> RouteBatch(second, std::vector<Fn>(fns, fns + count)))?count:0;
+	}
+
+	virtual std::size_t getQueueDepth(Priority priority) throw () {
+		return first.getQueueDepth(priority);
 	}
 protected:
 	DispatchFn first;
 	DispatchFn second;
 
+	class RouteBatch {
+	public:
+		RouteBatch(const DispatchFn &target, std::vector<Fn> &&batch):target(target),batch(std::move(batch)) {}
+		void operator()() {
+			std::size_t n = target.dispatchBatch(batch);
+			for (std::size_t i = n; i < batch.size(); i++) {
+				if (batch[i] != nullptr) batch[i]->execute();
+			}
+		}
+	protected:
+		DispatchFn target;
+		std::vector<Fn> batch;
+	};
+
 };
 
 DispatchFn operator >> (DispatchFn first, DispatchFn second)
@@ -233,10 +458,12 @@ public:
 		:first(first) {}
 
 	virtual bool dispatch(const Fn &fn) throw () {
+		if (fn == nullptr) return first >> fn;
+		return AbstractDispatchedFunction::dispatchRouted(first, DispatchFn::newThread(), fn);
+	}
 
-		return first >> [fn] {
-			newThread >> [fn] {fn->run(); };
-		};
+	virtual std::size_t getQueueDepth(Priority priority) throw () {
+		return first.getQueueDepth(priority);
 	}
 protected:
 	DispatchFn first;
@@ -255,11 +482,78 @@ DispatchFn operator >> (DispatchFn first, _XThisThread)
 	return first >> DispatchFn::thisThread();
 }
 
+///Dispatcher which sets an attribute to each task and passes the task to the target
+template<typename Setter>
+class AttributeDispatcher : public AbstractDispatcher {
+public:
+	AttributeDispatcher(DispatchFn target, const Setter &setter)
+		:target(target), setter(setter) {}
+
+	virtual bool dispatch(const Fn &fn) throw () {
+		return target >> mark(fn);
+	}
+
+	virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw () {
+		std::vector<Fn> batch;
+		batch.reserve(count);
+		for (std::size_t i = 0; i < count; i++) batch.push_back(mark(fns[i]));
+		return target.dispatchBatch(batch);
+	}
+
+	virtual std::size_t getQueueDepth(Priority priority) throw () {
+		return target.getQueueDepth(priority);
+	}
+protected:
+	DispatchFn target;
+	Setter setter;
+
+	///Sets the attribute to the task (the task routed by other thread is wrapped first)
+	Fn mark(const Fn &fn) const {
+		Fn task = AbstractDispatchedFunction::prepare(fn);
+		if (task != nullptr) setter(*task);
+		return task;
+	}
+};
+
+struct SetPriority {
+	Priority priority;
+	void operator()(AbstractDispatchedFunction &fn) const {fn.setPriority(priority);}
+};
+
+struct SetDeadline {
+	Timeout deadline;
+	void operator()(AbstractDispatchedFunction &fn) const {fn.setDeadline(deadline);}
+};
+
+DispatchFn DispatchFn::withPriority(Priority priority) const {
+	SetPriority s = {priority};
+	RefCntPtr<AbstractDispatcher> d(new AttributeDispatcher<SetPriority>(*this, s));
+	return d;
+}
+
+DispatchFn DispatchFn::withDeadline(const Timeout &deadline) const {
+	SetDeadline s = {deadline};
+	RefCntPtr<AbstractDispatcher> d(new AttributeDispatcher<SetDeadline>(*this, s));
+	return d;
+}
+
 bool yield() {
 	if (queueControl == nullptr) return false;
 	else return queueControl->yield();
 }
 
+void yieldOrHalt() {
+	if (queueControl == nullptr) halt();
+	else queueControl->yieldOrHalt();
+}
+
+void _hlp::resetThreadDispatcher() {
+	if (curDispatcher != nullptr) {
+		curDispatcher->close();
+		curDispatcher = nullptr;
+	}
+}
+
 void IDispatchQueueControl::setThreadQueueControl(IDispatchQueueControl *qc) {
 	queueControl = qc;
 }
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <thread>
+#include <vector>
 #include "refcnt.h"
 #include "alertfn.h"
+#include "objpool.h"
+#include "timeout.h"
 
 
 namespace yasync {
@@ -17,14 +21,104 @@ namespace yasync {
 	};
 
 
-class Timeout;
+class DispatchQueue;
+class DispatchFn;
 
-class AbstractDispatchedFunction: public RefCntObj {
+///Priority of the dispatched function
+/** Dispatchers which have a queue serve functions with higher priority first. Lower priorities
+ * are aged, so they cannot starve. See DispatchFn::withPriority()
+ */
+enum Priority {
+	///background functions
+	lowPriority = 0,
+	///default priority
+	normalPriority = 1,
+	///latency-critical functions
+	highPriority = 2
+};
+
+///Count of priority levels
+static const unsigned int priorityLevels = 3;
+
+///Task which can be dispatched
+/** The task is allocated once and the same object is carried through all dispatchers. Dispatchers
+ * which route the task through other dispatchers (for example first >> second) store the route
+ * to the task itself, so the task is not wrapped into another task on each hop.
+ *
+ * Dispatchers execute the task by the function execute(). The function run() contains the
+ * code of the task.
+ */
+class AbstractDispatchedFunction: public RefCntObj, public PoolAlloc {
 public:
 
+	AbstractDispatchedFunction() :nextInQueue(nullptr), queued(false), route(nullptr), routed(false), priority(normalPriority), deadline(nullptr) {}
 	virtual void run() throw() = 0;
-	virtual ~AbstractDispatchedFunction() {}
 
+	///Called instead of run() when the task missed its deadline
+	/** The default implementation does nothing. Tasks which resolve a future override the function
+	 * and resolve the future with the DeadlineExceeded exception. */
+	virtual void expired() throw() {}
+	virtual ~AbstractDispatchedFunction();
+
+	///Executes the task
+	/** If the task is routed, it is passed to the next dispatcher on the route. Otherwise it
+	 * calls run(). If the next dispatcher rejects the task, the task continues by the following
+	 * dispatcher, or runs in the current thread.
+	 *
+	 * If the deadline of the task has expired, the task is neither routed nor run, the function
+	 * calls expired() instead.
+	 */
+	void execute() throw();
+
+	///Dispatches the task through the dispatcher and then routes it to the next dispatcher
+	/**
+	 * @param first dispatcher which receives the task
+	 * @param next dispatcher where the task is passed once the first dispatcher executes it
+	 * @param fn task
+	 * @return result of dispatching through the first dispatcher
+	 */
+	static bool dispatchRouted(const DispatchFn &first, const DispatchFn &next, const RefCntPtr<AbstractDispatchedFunction> &fn) throw();
+
+	///Prepares the task for the dispatching
+	/** If the task is currently carried through a route by other thread, it is wrapped
+	 * into new task, so both routes are independent
+	 */
+	static RefCntPtr<AbstractDispatchedFunction> prepare(const RefCntPtr<AbstractDispatchedFunction> &fn);
+
+	///Retrieves priority of the task
+	Priority getPriority() const {return priority;}
+	///Sets priority of the task
+	/** The priority is carried with the task through the whole route */
+	void setPriority(Priority priority) {this->priority = priority;}
+
+	///Retrieves deadline of the task
+	const Timeout &getDeadline() const {return deadline;}
+	///Sets deadline of the task
+	/** The task which is executed after its deadline is dropped, see execute(). Default deadline is infinite */
+	void setDeadline(const Timeout &deadline) {this->deadline = deadline;}
+
+protected:
+	struct RouteHop;
+
+	///Link to the next function in the DispatchQueue
+	AbstractDispatchedFunction *nextInQueue;
+	///True, while the function is waiting in a DispatchQueue
+	std::atomic<bool> queued;
+	///Remaining route of the task (the next dispatcher is on the top)
+	RouteHop *route;
+	///True, while the task is carried through a route
+	std::atomic<bool> routed;
+	///Priority of the task
+	Priority priority;
+	///Deadline of the task
+	Timeout deadline;
+
+	///Moves route to the other task
+	void moveRouteTo(AbstractDispatchedFunction &other) throw();
+	///Deletes the route
+	void clearRoute() throw();
+
+	friend class DispatchQueue;
 };
 
 class AbstractDispatcher: public RefCntObj {
@@ -34,6 +128,34 @@ public:
 
 	virtual bool dispatch(const Fn &fn) throw() = 0;
 
+	///Dispatches multiple functions at once
+	/**
+	 * @param fns pointer to the first function
+	 * @param count count of functions
+	 * @return count of dispatched functions. The functions are dispatched in order, so
+	 * the return value is also index of the first rejected function.
+	 *
+	 * Default implementation dispatches the functions one by one. Dispatchers
+	 * override the function to enqueue whole batch under single lock and with single wakeup
+	 */
+	virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw() {
+		for (std::size_t i = 0; i < count; i++) {
+			if (!dispatch(fns[i])) return i;
+		}
+		return count;
+	}
+
+	///Retrieves count of functions waiting in the queue of the dispatcher
+	/**
+	 * @param priority priority lane
+	 * @return count of functions with given priority waiting in the queue. Dispatchers
+	 * without a queue return 0. The value is informative only, it can change anytime
+	 */
+	virtual std::size_t getQueueDepth(Priority priority) throw() {
+		(void)priority;
+		return 0;
+	}
+
 	virtual ~AbstractDispatcher() {}
 
 };
@@ -45,10 +167,12 @@ public:
 	virtual void run() throw() {
 		fn();
 	}
-	DispatchedFunction(const Fn &fn) :fn(fn) {}
+	template<typename X>
+	DispatchedFunction(X &&fn) :fn(std::forward<X>(fn)) {}
 	
-	static RetT dispatch(AbstractDispatcher *disp, const Fn &fn) {
-		return disp->dispatch(new DispatchedFunction(fn));
+	template<typename X>
+	static RetT dispatch(AbstractDispatcher *disp, X &&fn) {
+		return disp->dispatch(new DispatchedFunction(std::forward<X>(fn)));
 	}
 	
 protected:
@@ -84,23 +208,115 @@ public:
 	/** Functions are dispatched through a queue. The last reference of this
 	    thread destroys the thread, but after all messages are dispatched */
 	static DispatchFn newDispatchThread();
+	///Creates strand - dispatcher which executes functions one by one on other dispatcher
+	/**
+	 * @param underlying dispatcher which executes the functions, typically a thread pool
+	 * @return dispatcher of the strand
+	 *
+	 * Functions dispatched to the strand are executed in order of arrival (see also
+	 * withPriority()), never concurrently, but without a dedicated thread. Once a function is
+	 * dispatched to the idle strand, the strand is scheduled to the underlying dispatcher. It
+	 * then processes queued functions in batches. After each batch, the strand is scheduled again, so
+	 * other tasks of the underlying dispatcher don't starve. If the underlying dispatcher rejects
+	 * the strand, the strand is closed and it rejects new functions.
+	 *
+	 * @see KeyedExecutor
+	 */
+	static DispatchFn strand(DispatchFn underlying);
 
 
 	///Dispatch a function to the target thread
 	/**
-	 * @param fn function to dispatch
+	 * @param fn function to dispatch. The function is moved to the dispatched task when it
+	 * is passed as rvalue, so it can carry move-only objects
 	 * @retval true function sent to the dispatcher
 	 * @retval false dispatcher is no longer connected to a thread, because the original
 	 * thread exited. Function was not dispatched
 	 */
 	template<typename Fn>
-	typename DispatchedFunction<Fn,typename std::result_of<Fn()>::type>::RetT operator>>(const Fn &fn) const throw() {
-		return DispatchedFunction<Fn, typename std::result_of<Fn()>::type>::dispatch(obj, fn);
+	typename DispatchedFunction<typename std::decay<Fn>::type,typename std::result_of<typename std::decay<Fn>::type()>::type>::RetT operator>>(Fn &&fn) const throw() {
+		typedef typename std::decay<Fn>::type F;
+		return DispatchedFunction<F, typename std::result_of<F()>::type>::dispatch(obj, std::forward<Fn>(fn));
 	}
 
 	///Dispatch already prepared AbstractDispatchedFunction
 	bool operator>>(const AbstractDispatcher::Fn &fn) const {
-		return obj->dispatch(fn);
+		return obj->dispatch(AbstractDispatchedFunction::prepare(fn));
+	}
+
+	///Dispatch multiple functions at once
+	/**
+	 * @param begin iterator to the first function
+	 * @param end iterator after the last function
+	 * @return count of dispatched functions. The functions are dispatched in order, so
+	 * the return value is also index of the first rejected function.
+	 *
+	 * Items can be functions without result or already prepared AbstractDispatchedFunction.
+	 * Whole batch is passed to the dispatcher by single call, so the dispatcher
+	 * can enqueue it under single lock and wake up only necessary count of threads
+	 */
+	template<typename Iter>
+	std::size_t dispatchBatch(Iter begin, Iter end) const {
+		std::vector<AbstractDispatcher::Fn> fns;
+		for (Iter it = begin; it != end; ++it) {
+			fns.push_back(makeFn(*it));
+		}
+		if (fns.empty()) return 0;
+		return obj->dispatchMany(fns.data(), fns.size());
+	}
+
+	///Dispatch multiple functions at once
+	/**
+	 * @param batch container of functions
+	 * @return count of dispatched functions
+	 * @see dispatchBatch(Iter,Iter)
+	 */
+	template<typename Container>
+	std::size_t dispatchBatch(const Container &batch) const {
+		return dispatchBatch(batch.begin(), batch.end());
+	}
+
+	///Creates dispatcher which dispatches functions with given priority
+	/**
+	 * @param priority priority of the functions
+	 * @return dispatcher which sets the priority to each function and passes the function to
+	 * this dispatcher
+	 *
+	 * @code
+	 * pool.withPriority(highPriority) >> []{...};
+	 * @endcode
+	 *
+	 * Thread pools and dispatching threads keep a queue for each priority level. Functions with
+	 * higher priority are executed first, however a waiting lower level is served once after
+	 * it has been skipped several times, so it cannot starve.
+	 */
+	DispatchFn withPriority(Priority priority) const;
+
+	///Creates dispatcher which dispatches functions with given deadline
+	/**
+	 * @param deadline deadline of the functions. Note that the deadline is absolute, so
+	 * withDeadline(100) expires 100 ms after this call, not after the dispatching
+	 * @return dispatcher which sets the deadline to each function and passes the function to
+	 * this dispatcher
+	 *
+	 * The function, which is picked for execution after its deadline, is dropped. If the function
+	 * returns a future, the future is resolved by the DeadlineExceeded exception. This applies to
+	 * all dispatchers. Thread pools can also order the functions by their deadlines, see
+	 * ThreadPool::setEarliestDeadlineFirst()
+	 *
+	 * @code
+	 * pool.withDeadline(200) >> []{...};
+	 * @endcode
+	 */
+	DispatchFn withDeadline(const Timeout &deadline) const;
+
+	///Retrieves count of functions waiting in the queue of the dispatcher
+	/**
+	 * @param priority priority lane
+	 * @return count of waiting functions with given priority
+	 */
+	std::size_t getQueueDepth(Priority priority) const {
+		return obj->getQueueDepth(priority);
 	}
 
 	bool operator==(const DispatchFn &other) const { return obj == other.obj; }
@@ -109,6 +325,14 @@ public:
 protected:
 	RefCntPtr<AbstractDispatcher> obj;
 
+	static AbstractDispatcher::Fn makeFn(const AbstractDispatcher::Fn &fn) {
+		return AbstractDispatchedFunction::prepare(fn);
+	}
+	template<typename Fn>
+	static AbstractDispatcher::Fn makeFn(const Fn &fn) {
+		return new DispatchedFunction<Fn, void>(fn);
+	}
+
 };
 
 
@@ -116,6 +340,10 @@ class IDispatchQueueControl {
 public:
 	virtual bool yield() throw() = 0;
 	virtual DispatchFn getDispatch() throw() = 0;
+	///Processes one function in the queue, or halts the thread until an alert or a new function comes
+	virtual void yieldOrHalt() throw() {
+		if (!yield()) halt();
+	}
 	virtual ~IDispatchQueueControl() {}
 	static void setThreadQueueControl(IDispatchQueueControl *qc);
 };
@@ -191,6 +419,26 @@ bool sleepAndDispatch(const Timeout &tm, std::uintptr_t *reason = nullptr);
  */
 std::uintptr_t haltAndDispatch();
 
+///Waits for dispatched functions and processes whole batch of them
+/**
+ * Function waits until a function is dispatched to the current thread, or until
+ * an alert or timeout. Then it processes all queued functions without returning to
+ * the caller, until the queue is empty or one of limits is reached.
+ *
+ * @param tm maximal timeout to wait for the first function. Use Timeout(nullptr)
+ *   to wait infinitely
+ * @param maxItems maximum count of functions processed in the batch. Value 0 means no limit
+ * @param maxTime time budget in milliseconds for the batch. When it is exhausted, the
+ *   function returns even if there are other functions in the queue. Value 0 means no limit
+ * @param reason reason carried through the alert
+ * @return count of processed functions. Zero is returned when waiting was
+ *  interrupted by an alert or timeout
+ *
+ * The function is much cheaper for threads processing many small functions, because the
+ * queue is drained without returning to the caller's loop for each item
+ */
+std::size_t dispatchAll(const Timeout &tm, std::size_t maxItems = 0, unsigned int maxTime = 0, std::uintptr_t *reason = nullptr);
+
 ///Creates dispatcher which executes function after given time
 /**
  This dispatcher can handle only one function. Second, and more functions
@@ -226,6 +474,22 @@ There can be more reasons why the function can return false
 
 bool yield();
 
+///Processes one function of the thread pool, or halts the thread
+/**
+In a thread of a thread pool, the function processes one function of the pool's queue. If
+there is none, the thread halts until it is alerted or until a function is dispatched to the
+pool, then it processes that function. The function is used by waiting functions (for example
+Future::wait()), so a thread of the pool which waits, helps the pool to process its queue. This
+prevents deadlocks when a function of the pool waits for other function of the same pool,
+and the pool has no free thread.
+
+Recursion is limited by ThreadPool::setMaxYieldRecursion(). Once the limit is reached, or when
+the function is called in other thread, it is equivalent to halt().
+
+@note the function can return without an alert, the caller must check its condition in a cycle.
+*/
+void yieldOrHalt();
+
 
 template<typename Fn, typename RetV>
 struct RunThreadFn;
@@ -233,21 +497,22 @@ struct RunThreadFn;
 template<typename Fn>
 struct RunThreadFn<Fn, void> {
 	typedef void ReturnType;
-	static void runThread(const Fn &fn) {
-		std::thread t(fn);
-		t.detach();
+	template<typename X>
+	static void runThread(X &&fn) {
+		DispatchFn::newThread() >> std::forward<X>(fn);
 	}
 };
 
 
 template<typename Fn>
-auto operator >> (_XNewThread, const Fn &fn) -> typename RunThreadFn<Fn, typename std::result_of<Fn()>::type>::ReturnType {
-	return RunThreadFn<Fn, typename std::result_of<Fn()>::type>::runThread(fn);
+auto operator >> (_XNewThread, Fn &&fn) -> typename RunThreadFn<typename std::decay<Fn>::type, typename std::result_of<typename std::decay<Fn>::type()>::type>::ReturnType {
+	typedef typename std::decay<Fn>::type F;
+	return RunThreadFn<F, typename std::result_of<F()>::type>::runThread(std::forward<Fn>(fn));
 }
 
 template<typename Fn>
-auto operator >> (_XThisThread, const Fn &fn) -> decltype(DispatchFn::thisThread() >> fn) {
-	return DispatchFn::thisThread() >> fn;
+auto operator >> (_XThisThread, Fn &&fn) -> decltype(DispatchFn::thisThread() >> std::forward<Fn>(fn)) {
+	return DispatchFn::thisThread() >> std::forward<Fn>(fn);
 }
 
 
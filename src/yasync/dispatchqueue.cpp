@@ -0,0 +1,175 @@
+#include "dispatchqueue.h"
+
+namespace yasync {
+
+namespace {
+
+	///Wraps function which is already waiting in other queue
+	class QueuedRef : public AbstractDispatchedFunction {
+	public:
+		QueuedRef(const AbstractDispatcher::Fn &fn) :fn(fn) {
+			priority = fn->getPriority();
+			deadline = fn->getDeadline();
+		}
+		virtual void run() throw() {
+			fn->run();
+		}
+		virtual void expired() throw() {
+			fn->expired();
+		}
+	protected:
+		AbstractDispatcher::Fn fn;
+	};
+
+}
+
+DispatchQueue::DispatchQueue():size(0) {}
+
+DispatchQueue::~DispatchQueue() {
+	for (Lane &lane : lanes) {
+		Node *top = lane.head.exchange(nullptr);
+		if (top != closedMark()) releaseList(top);
+		releaseList(lane.fifo);
+	}
+}
+
+DispatchQueue::Node *DispatchQueue::prepare(const Fn &fn) throw() {
+	Fn item = fn;
+	if (item->queued.exchange(true)) {
+		item = new QueuedRef(fn);
+		item->queued.store(true);
+		//the route belongs to this dispatching
+		fn->moveRouteTo(*item);
+	}
+	Node *node = item;
+	//the queue holds the reference, it must be added before the consumer can see the node
+	node->addRef();
+	return node;
+}
+
+DispatchQueue::PushResult DispatchQueue::publish(Lane &lane, Node *top, Node *bottom, std::size_t count) throw() {
+	//depth is counted before the consumer can see the nodes, so it never underflows
+	lane.depth.fetch_add(count, std::memory_order_relaxed);
+	Node *cur = lane.head.load(std::memory_order_relaxed);
+	do {
+		if (cur == closedMark()) {
+			bottom->nextInQueue = nullptr;
+			releaseList(top);
+			lane.depth.fetch_sub(count, std::memory_order_relaxed);
+			return rejected;
+		}
+		bottom->nextInQueue = cur;
+	} while (!lane.head.compare_exchange_weak(cur, top, std::memory_order_release, std::memory_order_relaxed));
+	//the lane can be empty while the consumer is processing fetched functions, so the whole queue is counted
+	return size.fetch_add(count, std::memory_order_acq_rel) == 0 ? queuedFirst : queued;
+}
+
+DispatchQueue::PushResult DispatchQueue::push(const Fn &fn) throw() {
+	if (fn == nullptr) return queued;
+	Node *node = prepare(fn);
+	return publish(lanes[node->getPriority()], node, node, 1);
+}
+
+DispatchQueue::PushResult DispatchQueue::push(const Fn *fns, std::size_t count) throw() {
+	//the batch is linked privately for each lane
+	Node *top[priorityLevels] = {};
+	Node *bottom[priorityLevels] = {};
+	std::size_t cnt[priorityLevels] = {};
+	for (std::size_t i = 0; i < count; i++) {
+		if (fns[i] == nullptr) continue;
+		Node *node = prepare(fns[i]);
+		unsigned int l = node->getPriority();
+		node->nextInQueue = top[l];
+		top[l] = node;
+		if (bottom[l] == nullptr) bottom[l] = node;
+		cnt[l]++;
+	}
+	PushResult res = queued;
+	for (unsigned int l = 0; l < priorityLevels; l++) {
+		if (top[l] == nullptr) continue;
+		PushResult r = publish(lanes[l], top[l], bottom[l], cnt[l]);
+		if (r == rejected || res == rejected) res = rejected;
+		else if (r == queuedFirst) res = queuedFirst;
+	}
+	return res;
+}
+
+void DispatchQueue::fetch(Lane &lane) throw() {
+	Node *top = lane.head.load(std::memory_order_relaxed);
+	do {
+		if (top == nullptr || top == closedMark()) return;
+	} while (!lane.head.compare_exchange_weak(top, nullptr, std::memory_order_acquire, std::memory_order_relaxed));
+	//reverse the stack and put it before current fifo, which is empty here
+	Node *lst = nullptr;
+	while (top) {
+		Node *x = top;
+		top = top->nextInQueue;
+		x->nextInQueue = lst;
+		lst = x;
+	}
+	lane.fifo = lst;
+}
+
+DispatchQueue::Fn DispatchQueue::pop() throw() {
+	int l = selector.select([this](int i) {return empty(lanes[i]);});
+	if (l < 0) return nullptr;
+	Lane &lane = lanes[l];
+	if (lane.fifo == nullptr) fetch(lane);
+	Node *x = lane.fifo;
+	lane.fifo = x->nextInQueue;
+	x->nextInQueue = nullptr;
+	lane.depth.fetch_sub(1, std::memory_order_relaxed);
+	size.fetch_sub(1, std::memory_order_acq_rel);
+	Fn res(x);
+	x->release();
+	x->queued.store(false, std::memory_order_release);
+	return res;
+}
+
+bool DispatchQueue::empty(const Lane &lane) const throw() {
+	if (lane.fifo) return false;
+	Node *top = lane.head.load(std::memory_order_relaxed);
+	return top == nullptr || top == closedMark();
+}
+
+bool DispatchQueue::empty() const throw() {
+	for (const Lane &lane : lanes) {
+		if (!empty(lane)) return false;
+	}
+	return true;
+}
+
+bool DispatchQueue::hasPending() const throw() {
+	for (const Lane &lane : lanes) {
+		Node *top = lane.head.load(std::memory_order_acquire);
+		if (top != nullptr && top != closedMark()) return true;
+	}
+	return false;
+}
+
+void DispatchQueue::close() throw() {
+	for (Lane &lane : lanes) {
+		Node *top = lane.head.exchange(closedMark(), std::memory_order_acquire);
+		std::size_t cnt = 0;
+		if (top != closedMark()) cnt += releaseList(top);
+		cnt += releaseList(lane.fifo);
+		lane.fifo = nullptr;
+		lane.depth.fetch_sub(cnt, std::memory_order_relaxed);
+		size.fetch_sub(cnt, std::memory_order_acq_rel);
+	}
+}
+
+std::size_t DispatchQueue::releaseList(Node *lst) throw() {
+	std::size_t cnt = 0;
+	while (lst) {
+		Node *x = lst;
+		lst = lst->nextInQueue;
+		x->nextInQueue = nullptr;
+		x->queued.store(false, std::memory_order_release);
+		if (x->release()) delete x;
+		cnt++;
+	}
+	return cnt;
+}
+
+}
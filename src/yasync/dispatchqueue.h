@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include "dispatcher.h"
+
+namespace yasync {
+
+namespace _hlp {
+
+///Selects the priority lane which is served next
+/** Lanes are served in strict priority order. However each waiting lane counts how many
+ * times it has been skipped. Once the count reaches the agingLimit, the lane is served once
+ * regardless on the higher lanes, so lower lanes cannot starve.
+ *
+ * @note The object is not MT safe, it must be protected by the consumer
+ */
+class LaneSelector {
+public:
+	///Count of skips before the waiting lane is served
+	static const unsigned int agingLimit = 8;
+
+	LaneSelector() {
+		for (unsigned int i = 0; i < priorityLevels; i++) skipped[i] = 0;
+	}
+
+	///Selects the lane
+	/**
+	 * @param isEmpty function which receives index of lane (priority) and returns true when the lane is empty
+	 * @return index of the selected lane, or -1 when all lanes are empty
+	 */
+	template<typename Fn>
+	int select(const Fn &isEmpty) {
+		int sel = -1;
+		int aged = -1;
+		for (int i = priorityLevels; i-- > 0;) {
+			if (isEmpty(i)) {
+				skipped[i] = 0;
+			} else if (sel < 0) {
+				sel = i;
+			} else if (++skipped[i] >= agingLimit && aged < 0) {
+				aged = i;
+			}
+		}
+		if (aged >= 0) sel = aged;
+		if (sel >= 0) skipped[sel] = 0;
+		return sel;
+	}
+
+protected:
+	unsigned int skipped[priorityLevels];
+};
+
+}
+
+///Lock-free queue of dispatched functions
+/** The queue is multi-producer single-consumer intrusive list linked through the
+ * AbstractDispatchedFunction. Producers push functions using CAS, the consumer takes all
+ * pushed functions at once by single atomic exchange and then processes them in order
+ * of arrival without touching the shared head.
+ *
+ * There is one list (lane) for each priority level. The consumer selects the lane
+ * by the LaneSelector.
+ *
+ * Function can be queued only once at time. If the function is already waiting in
+ * other queue, it is wrapped to a new dispatched function.
+ *
+ * Only one thread can call pop() and close(). Any thread can call push()
+ */
+class DispatchQueue {
+public:
+	typedef AbstractDispatcher::Fn Fn;
+
+	enum PushResult {
+		///queue is closed, function has not been queued
+		rejected,
+		///function queued
+		queued,
+		///function queued to the empty queue, consumer should be alerted
+		/** The queue is empty when there are no functions waiting in any lane, including
+		functions already fetched by the consumer */
+		queuedFirst
+	};
+
+	DispatchQueue();
+	~DispatchQueue();
+
+	///Pushes the function to the queue
+	/**
+	 * @param fn function to push. Empty function is ignored
+	 * @return result of the operation
+	 */
+	PushResult push(const Fn &fn) throw();
+
+	///Pushes multiple functions to the queue at once
+	/**
+	 * @param fns pointer to the first function
+	 * @param count count of functions
+	 * @return result of the operation. The functions are queued in order. Empty functions are ignored
+	 *
+	 * Whole batch is linked privately and then it is published by single atomic operation
+	 */
+	PushResult push(const Fn *fns, std::size_t count) throw();
+
+	///Removes the first function from the queue
+	/**
+	 * @return the function with the highest priority (see LaneSelector) or nullptr if queue is empty
+	 * @note consumer only
+	 */
+	Fn pop() throw();
+
+	///Retrieves count of queued functions with given priority
+	/** @note any thread, value is informative only */
+	std::size_t getDepth(Priority priority) const throw() {
+		return lanes[priority].depth.load(std::memory_order_relaxed);
+	}
+
+	///Determines, whether the queue is empty
+	/** @note consumer only */
+	bool empty() const throw();
+
+	///Determines, whether there are functions pushed but not yet fetched by the consumer
+	/** @note any thread. The consumer which has emptied the queue can use the function to detect
+	 * functions pushed meanwhile */
+	bool hasPending() const throw();
+
+	///Closes the queue and releases all queued functions
+	/** Closed queue rejects new functions
+	 * @note consumer only */
+	void close() throw();
+
+protected:
+	typedef AbstractDispatchedFunction Node;
+
+	struct Lane {
+		///Stack of pushed functions (the last pushed is on top)
+		std::atomic<Node *> head;
+		///Functions taken from the stack in order of arrival. Accessed by the consumer only
+		Node *fifo;
+		///Count of functions in the lane
+		std::atomic<std::size_t> depth;
+
+		Lane():head(nullptr),fifo(nullptr),depth(0) {}
+	};
+
+	Lane lanes[priorityLevels];
+	///Count of functions in the queue (all lanes)
+	/** Producers add to the count after the functions are published, so the consumer can take the function
+	before it is counted and the count can temporarily wrap below zero. The producer, which adds to zero, queued the
+	first function. This is the transition which needs alert, because the consumer could find the queue empty */
+	std::atomic<std::size_t> size;
+	///Selects the lane for the pop() (consumer only)
+	_hlp::LaneSelector selector;
+
+	Node *closedMark() const {
+		return reinterpret_cast<Node *>(const_cast<DispatchQueue *>(this));
+	}
+
+	///Takes whole stack and appends it to the fifo
+	void fetch(Lane &lane) throw();
+	///Determines whether the lane is empty (consumer only)
+	bool empty(const Lane &lane) const throw();
+
+	///Prepares the node for the function and adds reference held by the queue
+	static Node *prepare(const Fn &fn) throw();
+	///Publishes the chain of nodes (top is the last node, bottom is the first node)
+	PushResult publish(Lane &lane, Node *top, Node *bottom, std::size_t count) throw();
+
+	///Releases the list
+	/** @return count of released nodes */
+	static std::size_t releaseList(Node *lst) throw();
+
+};
+
+}
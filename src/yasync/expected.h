@@ -0,0 +1,133 @@
+#pragma once
+
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace yasync {
+
+///Carries an error which is used to construct Expected
+template<typename E>
+class Unexpected {
+public:
+	explicit Unexpected(const E &e) :e(e) {}
+	explicit Unexpected(E &&e) :e(std::move(e)) {}
+
+	const E &error() const { return e; }
+	E &error() { return e; }
+protected:
+	E e;
+};
+
+///Creates Unexpected object
+template<typename E>
+Unexpected<typename std::decay<E>::type> makeUnexpected(E &&e) {
+	return Unexpected<typename std::decay<E>::type>(std::forward<E>(e));
+}
+
+
+///Contains either value or an error
+/** Expected is designed to carry expected failures (cache miss, timeout, not found) through the
+ * future chains by value. Use Future<Expected<T,E> > when a failure is part of the normal
+ * control flow. Handlers receive the Expected object and can branch on it, so no exception is
+ * thrown or caught anywhere in the chain. Exceptions remain reserved for unexpected failures.
+ *
+ * @code
+ * Future<Expected<Record> > f = cache.lookup(key);
+ * f >> [](const Expected<Record> &r) {
+ *     if (r) use(r.value());
+ *     else if (r.error() == std::errc::timed_out) retry();
+ * };
+ *
+ * promise.setValue(makeUnexpected(std::make_error_code(std::errc::timed_out)));
+ * @endcode
+ *
+ * @tparam T type of value
+ * @tparam E type of error. Default is std::error_code
+ */
+template<typename T, typename E = std::error_code>
+class Expected {
+public:
+
+	typedef T ValueType;
+	typedef E ErrorType;
+
+	Expected(const T &v) :valid(true) { new(&space) T(v); }
+	Expected(T &&v) :valid(true) { new(&space) T(std::move(v)); }
+	template<typename X>
+	Expected(const Unexpected<X> &e) :valid(false) { new(&space) E(e.error()); }
+	template<typename X>
+	Expected(Unexpected<X> &&e) :valid(false) { new(&space) E(std::move(e.error())); }
+
+	Expected(const Expected &other) :valid(other.valid) {
+		if (valid) new(&space) T(other.value());
+		else new(&space) E(other.error());
+	}
+	Expected(Expected &&other) :valid(other.valid) {
+		if (valid) new(&space) T(std::move(other.value()));
+		else new(&space) E(std::move(other.error()));
+	}
+	~Expected() {
+		destroy();
+	}
+
+	Expected &operator=(const Expected &other) {
+		if (this != &other) {
+			Expected tmp(other);
+			destroy();
+			constructFrom(std::move(tmp));
+		}
+		return *this;
+	}
+	Expected &operator=(Expected &&other) {
+		if (this != &other) {
+			destroy();
+			constructFrom(std::move(other));
+		}
+		return *this;
+	}
+
+	///Returns true, when object carries value
+	bool hasValue() const { return valid; }
+	///Returns true, when object carries value
+	explicit operator bool() const { return valid; }
+	///Returns true, when object carries error
+	bool operator!() const { return !valid; }
+
+	///Retrieves value. The object must carry the value
+	const T &value() const { return *reinterpret_cast<const T *>(&space); }
+	///Retrieves value. The object must carry the value
+	T &value() { return *reinterpret_cast<T *>(&space); }
+	///Retrieves error. The object must carry the error
+	const E &error() const { return *reinterpret_cast<const E *>(&space); }
+	///Retrieves error. The object must carry the error
+	E &error() { return *reinterpret_cast<E *>(&space); }
+
+	///Retrieves value, or the default value when the object carries error
+	T valueOr(const T &def) const { return valid ? value() : def; }
+
+protected:
+	typedef typename std::aligned_storage<
+		(sizeof(T) > sizeof(E) ? sizeof(T) : sizeof(E)),
+		(std::alignment_of<T>::value > std::alignment_of<E>::value ? std::alignment_of<T>::value : std::alignment_of<E>::value)
+	>::type Space;
+
+	Space space;
+	bool valid;
+
+	void destroy() {
+		if (valid) value().~T();
+		else error().~E();
+	}
+
+	void constructFrom(Expected &&other) {
+		valid = other.valid;
+		if (valid) new(&space) T(std::move(other.value()));
+		else new(&space) E(std::move(other.error()));
+	}
+
+};
+
+
+}
@@ -1,11 +1,17 @@
 #pragma once
 
 
+#include <atomic>
 #include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <thread>
 #include "refcnt.h"
 #include "fastmutex.h"
 #include "lockScope.h"
 #include "dispatcher.h"
+#include "objpool.h"
 
 namespace yasync {
 
@@ -14,12 +20,36 @@ namespace yasync {
 		const char *what() const throw() {
 			return "Promise has been canceled";
 		}
+
+		///Retrieves shared exception pointer which carries CanceledPromise
+		/** The exception object is created only once. Canceling a promise
+		 * then doesn't need to throw and catch the exception nor allocate memory */
+		static const std::exception_ptr &getExceptionPtr() {
+			static std::exception_ptr e = std::make_exception_ptr(CanceledPromise());
+			return e;
+		}
+	};
+
+	///Promise of the dispatched function has been canceled, because the function missed its deadline
+	/** @see DispatchFn::withDeadline() */
+	class DeadlineExceeded : public CanceledPromise {
+	public:
+		const char *what() const throw() {
+			return "Deadline exceeded";
+		}
+
+		///Retrieves shared exception pointer which carries DeadlineExceeded
+		static const std::exception_ptr &getExceptionPtr() {
+			static std::exception_ptr e = std::make_exception_ptr(DeadlineExceeded());
+			return e;
+		}
 	};
 
 
 	template<typename T> class Promise;
 	template<typename T> class Future;
 	template<typename T, typename U> class DispatchedFuture;
+	template<typename T, typename Stage> class FutureChain;
 	template<> class Promise<void>;
 	template<> class Future<void>;
 	class Checkpoint;
@@ -31,6 +61,12 @@ public:
 
 	AbstractPromiseObserver() :next(0) {}
 	virtual void operator()(const T &value) throw() = 0;
+	///Called with the value, which can be moved out
+	/** The future calls this variant for the last observer when there is no other consumer of
+	the value (no Future variable exists). The default implementation calls the const variant */
+	virtual void operator()(T &&value) throw() {
+		this->operator()(static_cast<const T &>(value));
+	}
 	virtual void operator()(const std::exception_ptr &exception) throw() = 0;
 	virtual ~AbstractPromiseObserver() {}
 protected:
@@ -65,6 +101,18 @@ namespace _hlp {
 			return fn();
 		}
 	};
+	///Passes stored value to a handler
+	/** Copyable values are passed by const reference. Move-only values cannot be copied,
+	so they are moved out and the handler consumes them. Such value can be consumed only once */
+	template<typename T, bool copyable = std::is_copy_constructible<T>::value>
+	struct PassValue {
+		static const T &pass(const T &v) { return v; }
+	};
+	template<typename T>
+	struct PassValue<T, false> {
+		static T &&pass(const T &v) { return std::move(const_cast<T &>(v)); }
+	};
+
 	template<>
 	struct CallHlp<Void> {
 		template<typename Fn, typename Arg>
@@ -85,6 +133,13 @@ template<typename T> class Future {
 	enum State {
 		///Promise is still unresolved
 		unresolved,
+		///Promise has been resolved by other future, which is still pending
+		/** Direct resolution is ignored, the future can be resolved only through the linked futures */
+		forwarded,
+		///The future shares the result with other future
+		/** The future has been linked to other future, which is in the state forwarded. All
+		operations are redirected to that future */
+		redirected,
 		///Promise is currently resolving
 		/** In this state, the promise object is executing observers,
 		however, the value of the promise still cannot be retrieved */
@@ -97,198 +152,430 @@ template<typename T> class Future {
 	friend class Promise<void>;
 
 
-	class Internal {
+	class Internal: public PoolAlloc {
 	public:
 		Internal()
-			: firstObserver(nullptr)
-			, pcnt(0)
-			, fcnt(0)
+			: hasValue(false)
+			, observers(nullptr)
+			, removers(0)
+			, refs(0)
+			, sources(0)
 			, state(unresolved)
+			, redirect(nullptr)
 		{}
 
-		template<typename X>
-		void notifyObserversLk(const X &val) {
-			while (firstObserver) {
-				AbstractPromiseObserver<T> *x = firstObserver;
-				firstObserver = firstObserver->next;
-				UnlockScope<FastMutex> _(lk);
-				(*x)(val);
+		void resolve(const T &v, bool linked = false) throw() {
+			if (!startResolve(linked)) {
+				if (isRedirected()) getRedirect()->resolve(v, true);
+				return;
 			}
-		}
-
-		void resolve(const T &v) throw() {
-			LockScope<FastMutex> _(lk);
-			if (state != unresolved) return;
-			state = resolving;
-			if (fcnt > pcnt) { //store result only if there are future variables
-				try {
-					value = std::unique_ptr<T>(new T(v));
-				}
-				catch (...) {
-					exception = std::current_exception();
-				}
-				notifyObserversLk(*value);
+			if (futures(refs) > 0) { //store result only if there are future variables
+				if (storeValue(v)) notifyObservers(*getValuePtr());
+				else notifyObservers(exception);
 			} else {
-				notifyObserversLk(v);
+				notifyObservers(v);
 			}
-			state = resolved;
+			state.store(resolved, std::memory_order_release);
 		}
 
-		void resolve(T &&v) throw() {
-			LockScope<FastMutex> _(lk);
-			if (state != unresolved) return;
-			state = resolving;
-			if (fcnt > pcnt) { //store result only if there are future variables
-				try {
-					value = std::unique_ptr<T>(new T(std::move(v)));
-				}
-				catch (...) {
-					exception = std::current_exception();
-				}
-				notifyObserversLk(*value);
+		void resolve(T &&v, bool linked = false) throw() {
+			if (!startResolve(linked)) {
+				if (isRedirected()) getRedirect()->resolve(std::move(v), true);
+				return;
+			}
+			if (futures(refs) > 0) { //store result only if there are future variables
+				if (storeValue(std::move(v))) notifyObservers(*getValuePtr());
+				else notifyObservers(exception);
 			} else {
-				notifyObserversLk(v);
+				notifyObserversMove(v);
 			}
-			state = resolved;
+			state.store(resolved, std::memory_order_release);
 		}
 
 
-		void resolve(const std::exception_ptr &e) throw() {
-			LockScope<FastMutex> _(lk);
-			if (state != unresolved) return;
-			state = resolving;
-			exception = e;
-			notifyObserversLk(exception);
-			state = resolved;
+		void resolve(const std::exception_ptr &e, bool linked = false) throw() {
+			if (!startResolve(linked)) {
+				if (isRedirected()) getRedirect()->resolve(e, true);
+				return;
+			}
+			finishException(e);
 		}
 
-		void addObserver(AbstractPromiseObserver<T> *obs) const throw() {
-			LockScope<FastMutex> _(lk);
-			if (state == resolved) {
-				UnlockScope<FastMutex> _(lk);
-				if (exception != nullptr) (*obs)(exception);
-				else (*obs)(*value);
+		///Resolves the future by other future
+		/** If the other future is pending and nobody else can see it, it is linked to this future. The other
+		future is redirected, so it shares the result with this future. This collapses chains of futures,
+		where each future is resolved by the next one. Otherwise, the result is forwarded through an observer
+
+		@param other other future
+		@param mayLink true if the caller gives up its reference to the other future, so the future can be linked
+		@param linked true if the function is called through the redirected future
+		*/
+		void resolveBy(Internal *other, bool mayLink, bool linked = false) throw() {
+			if (!startForward(linked)) {
+				if (isRedirected()) getRedirect()->resolveBy(other, mayLink, true);
 				return;
 			}
-			AbstractPromiseObserver<T> **x = &firstObserver;
-			while (*x != nullptr) {
-				x = &(*x)->next;
+			if (mayLink && other != this && link(other)) return;
+			other->addObserver(new ForwardObserver(this));
+		}
+
+		void addObserver(AbstractPromiseObserver<T> *obs) const throw() {
+			if (!pushObserver(obs)) {
+				//list is closed, result is already available or the future is redirected
+				if (isRedirected()) getRedirect()->addObserver(obs);
+				else callObserverNow(obs);
 			}
-			*x = obs;
 		}
 
 		bool callObserver(AbstractPromiseObserver<T> *obs) const throw() {
-			LockScope<FastMutex> _(lk);
-			if (state == resolved) {
-				UnlockScope<FastMutex> _(lk);
-				if (exception != nullptr) (*obs)(exception);
-				else (*obs)(*value);
+			State st = state.load(std::memory_order_acquire);
+			if (st == redirected) return getRedirect()->callObserver(obs);
+			if (st == resolved) {
+				callObserverNow(obs);
 				return true;
 			}
 			return false;
 		}
 
 		bool addObserverIfPending(AbstractPromiseObserver<T> *obs) const throw() {
-			LockScope<FastMutex> _(lk);
-			if (state == resolved) {
-				return false;
-			}
-			AbstractPromiseObserver<T> **x = &firstObserver;
-			while (*x != nullptr) {
-				x = &(*x)->next;
-			}
-			*x = obs;
-			return true;
+			if (pushObserver(obs)) return true;
+			if (isRedirected()) return getRedirect()->addObserverIfPending(obs);
+			return false;
 		}
 
 		bool removeObserver(AbstractPromiseObserver<T> *obs) const throw() {
-			LockScope<FastMutex> _(lk);
-			AbstractPromiseObserver<T> **x = &firstObserver;
-			while (*x != nullptr) {
-				if (*x == obs) {
-					*x = obs->next;
-					return true;
-				}
-				x = &(*x)->next;
+			bool res;
+			{
+				//removing is rare, so removers are serialized through the lock. The counter
+				//removers stops the resolving thread until unlinking is done
+				LockScope<FastMutex> _(lk);
+				removers.fetch_add(1);
+				res = unlinkObserver(obs);
+				removers.fetch_sub(1);
 			}
-			return false;
+			if (!res && isRedirected()) return getRedirect()->removeObserver(obs);
+			return res;
 		}
 
 		void addRefPromise() throw() {
-			LockScope<FastMutex> _(lk);
-			fcnt++;
-			pcnt++;
+			refs += promiseRef;
 		}
 
 		bool releasePromise() throw() {
-			LockScope<FastMutex> _(lk);
-			pcnt--;
-			if (pcnt == 0) {
-				try {
-					throw CanceledPromise();
-				}
-				catch (...) {
-					UnlockScope<FastMutex> _(lk);
-					resolve(std::current_exception());
+			//the reference is kept as the future reference until the cancelation is finished
+			RefCount r = refs.fetch_sub(promiseRef - futureRef) - (promiseRef - futureRef);
+			if (promises(r) == 0) {
+				//nobody can resolve the future, cancel it. Redirected future releases the link
+				State st = unresolved;
+				if (state.compare_exchange_strong(st, resolving)
+					|| (st == forwarded && state.compare_exchange_strong(st, resolving))) {
+					finishException(CanceledPromise::getExceptionPtr());
+				} else if (st == redirected) {
+					Internal *t = getRedirect();
+					t->releaseSource();
+					if (t->releasePromise()) delete t;
 				}
 			}
-			fcnt--;
-			return fcnt == 0;
+			return release();
 		}
 
-		void cancel(const std::exception_ptr &e) {
-			AbstractPromiseObserver<T> *obs, *item;
-			{
-				LockScope<FastMutex> _(lk);
-				obs = firstObserver;
-				firstObserver = nullptr;
-				state = resolved;
-				exception = e;
-			}
-			while (obs != nullptr) {
-				item = obs;
-				obs = obs->next;
-				item->operator()(e);
+		///Releases the source, which can resolve the forwarded future
+		/** Sources are linked futures and forwarding observers. Once the last source is released
+		and the future is still forwarded, nobody can resolve it, so it is canceled */
+		void releaseSource() throw() {
+			if (--sources == 0) {
+				State st = forwarded;
+				if (state.compare_exchange_strong(st, resolving)) {
+					finishException(CanceledPromise::getExceptionPtr());
+				}
 			}
 		}
 
 		const T *getValue() const {
-			return value.get();
+			if (isRedirected()) return getRedirect()->getValue();
+			return hasValue?getValuePtr():nullptr;
+		}
+
+		T *getValue() {
+			if (isRedirected()) return getRedirect()->getValue();
+			return hasValue?getValuePtr():nullptr;
 		}
 
 		std::exception_ptr getException() const {
+			if (isRedirected()) return getRedirect()->getException();
 			return exception;
 		}
 
 		State getState() const {
-			return state;
+			State st = state.load(std::memory_order_acquire);
+			return st == redirected ? getRedirect()->getState() : st;
 		}
 
 		void addRef() {
-			LockScope<FastMutex> _(lk);
-			fcnt++;
-
+			refs += futureRef;
 		}
 		bool release() {
-			LockScope<FastMutex> _(lk);
-			fcnt--;
-			return fcnt == 0;
+			return refs.fetch_sub(futureRef) == futureRef;
 		}
 
 		bool hasPromise() const {
-			LockScope<FastMutex> _(lk);
-			return pcnt > 0 || state != unresolved;
+			return promises(refs) > 0 || state.load(std::memory_order_acquire) != unresolved;
+		}
+
+		///Determines, whether the future is held by one Future variable and one promise only and nobody observes it
+		bool isExclusive() const {
+			return refs == futureRef + promiseRef && observers.load(std::memory_order_acquire) == nullptr;
 		}
 
 
+		~Internal() {
+			if (hasValue) getValuePtr()->~T();
+			if (state.load(std::memory_order_acquire) == redirected) {
+				Internal *r = getRedirect();
+				if (r->release()) delete r;
+			}
+		}
+
+		///Resolves the target future by the result of the observed future
+		/** The observer holds the promise of the target */
+		class ForwardObserver : public AbstractPromiseObserver<T>, public PoolAlloc {
+		public:
+			ForwardObserver(Internal *target) :target(target) {
+				target->addRefPromise();
+				target->sources++;
+			}
+			virtual void operator()(const T &value) throw() {
+				target->resolve(_hlp::PassValue<T>::pass(value), true);
+				finish();
+			}
+			virtual void operator()(T &&value) throw() {
+				target->resolve(std::move(value), true);
+				finish();
+			}
+			virtual void operator()(const std::exception_ptr &exception) throw() {
+				target->resolve(exception, true);
+				finish();
+			}
+		protected:
+			Internal *target;
+			void finish() {
+				target->releaseSource();
+				if (target->releasePromise()) delete target;
+				delete this;
+			}
+		};
+
+
 	protected:
+		///Storage for the value, it is constructed in place, so resolving doesn't allocate
+		typedef typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type ValueSpace;
+		typedef AbstractPromiseObserver<T> Observer;
+
 		mutable FastMutex lk;
-		std::unique_ptr<T> value;
+		ValueSpace valueSpace;
 		std::exception_ptr exception;
-		AbstractPromiseObserver<T> mutable *firstObserver;
-		
-		unsigned int pcnt, fcnt;
-		State state;
+		///true, if the valueSpace contains constructed value
+		bool hasValue;
+		///Stack of observers (the last added is on the top).
+		/** Observers are pushed using CAS. Resolving thread swaps out whole stack at once
+		and replaces it by a closing mark. */
+		mutable std::atomic<Observer *> observers;
+		///count of threads currently inside of removeObserver()
+		mutable std::atomic<unsigned int> removers;
+
+		///References of Future variables (lower half) and promises (upper half)
+		/** Both counters are in one variable, so they can be read at once */
+		typedef unsigned long long RefCount;
+		static const RefCount futureRef = 1;
+		static const RefCount promiseRef = RefCount(1) << 32;
+		std::atomic<RefCount> refs;
+		///Count of linked futures and forwarding observers, which can resolve the forwarded future
+		std::atomic<unsigned int> sources;
+		std::atomic<State> state;
+		///Target of the redirected future. The pointer is valid in the state redirected
+		/** The redirected future holds a reference to the target and a promise reference until its
+		last promise is released. The target is never redirected, so the redirection has always one level */
+		std::atomic<Internal *> redirect;
+
+		static unsigned int futures(RefCount r) {
+			return static_cast<unsigned int>(r & (promiseRef - 1));
+		}
+		static unsigned int promises(RefCount r) {
+			return static_cast<unsigned int>(r >> 32);
+		}
+
+		bool isRedirected() const {
+			return state.load(std::memory_order_acquire) == redirected;
+		}
+		Internal *getRedirect() const {
+			return redirect.load(std::memory_order_acquire);
+		}
+
+		T *getValuePtr() {
+			return reinterpret_cast<T *>(&valueSpace);
+		}
+		const T *getValuePtr() const {
+			return reinterpret_cast<const T *>(&valueSpace);
+		}
+
+		///Value of the observers once the future is resolving or resolved
+		Observer *closedMark() const {
+			return reinterpret_cast<Observer *>(const_cast<Internal *>(this));
+		}
+
+		///constructs the value in the storage
+		/**
+		@retval true value stored
+		@retval false constructor thrown an exception, it has been stored instead
+		*/
+		template<typename X>
+		bool storeValue(X &&v) throw() {
+			try {
+				new(&valueSpace) T(std::forward<X>(v));
+				hasValue = true;
+				return true;
+			}
+			catch (...) {
+				exception = std::current_exception();
+				return false;
+			}
+		}
+
+		///Switches state from unresolved to resolving. Only one thread can win
+		/**
+		@param linked true if the resolution comes through a linked future, which can resolve
+		the future in the state forwarded.
+		*/
+		bool startResolve(bool linked) {
+			State st = unresolved;
+			if (state.compare_exchange_strong(st, resolving)) return true;
+			return linked && st == forwarded && state.compare_exchange_strong(st, resolving);
+		}
+
+		///Switches state from unresolved to forwarded
+		bool startForward(bool linked) {
+			State st = unresolved;
+			if (state.compare_exchange_strong(st, forwarded)) return true;
+			return linked && st == forwarded;
+		}
+
+		void finishException(const std::exception_ptr &e) {
+			exception = e;
+			notifyObservers(exception);
+			state.store(resolved, std::memory_order_release);
+		}
+
+		///Links other pending future to this future
+		/** The other future must not be visible to anybody else than the caller, otherwise its observers
+		and other variables would see the result of this future (which can be canceled)
+
+		@retval true linked, other future is redirected to this future
+		@retval false other future is not pending, it is observed or held by other variables,
+		or it is already linked somewhere
+		*/
+		bool link(Internal *other) {
+			if (futures(other->refs) != 1 || other->observers.load(std::memory_order_acquire) != nullptr) return false;
+			Internal *exp = nullptr;
+			if (!other->redirect.compare_exchange_strong(exp, this)) return false;
+			//references held by the other future, they must exist before the other future is redirected
+			addRefPromise();
+			addRef();
+			sources++;
+			State st = unresolved;
+			if (!other->state.compare_exchange_strong(st, redirected)) {
+				//the other future is being resolved. Counters can't drop to zero, because the caller holds a promise
+				sources--;
+				refs -= promiseRef + futureRef;
+				return false;
+			}
+			Observer *lst = other->closeObservers();
+			while (lst) {
+				Observer *x = lst;
+				lst = lst->next;
+				addObserver(x);
+			}
+			return true;
+		}
+
+		///Pushes observer to the stack
+		/**
+		@retval true pushed
+		@retval false stack is already closed
+		*/
+		bool pushObserver(Observer *obs) const {
+			Observer *top = observers.load(std::memory_order_acquire);
+			do {
+				if (top == closedMark()) return false;
+				obs->next = top;
+			} while (!observers.compare_exchange_weak(top, obs, std::memory_order_release, std::memory_order_acquire));
+			return true;
+		}
+
+		///Calls observer with the stored result
+		void callObserverNow(Observer *obs) const {
+			if (exception != nullptr) (*obs)(exception);
+			else (*obs)(*getValuePtr());
+		}
+
+		bool unlinkObserver(Observer *obs) const {
+			Observer *top = observers.load();
+			while (top != closedMark()) {
+				if (top == nullptr) return false;
+				if (top == obs) {
+					if (observers.compare_exchange_strong(top, obs->next)) return true;
+				} else {
+					//observers under the top are changed by removers only - which are serialized
+					Observer *x = top;
+					while (x->next != nullptr) {
+						if (x->next == obs) {
+							x->next = obs->next;
+							return true;
+						}
+						x = x->next;
+					}
+					return false;
+				}
+			}
+			return false;
+		}
+
+		///Closes the stack and returns observers in order of registration
+		Observer *closeObservers() {
+			Observer *lst = observers.exchange(closedMark());
+			//wait for removers which could see the stack before it has been closed
+			while (removers.load() != 0) std::this_thread::yield();
+			Observer *fifo = nullptr;
+			while (lst) {
+				Observer *x = lst;
+				lst = lst->next;
+				x->next = fifo;
+				fifo = x;
+			}
+			return fifo;
+		}
+
+		///Closes the stack and calls all observers in order of registration
+		template<typename X>
+		void notifyObservers(const X &val) {
+			Observer *fifo = closeObservers();
+			while (fifo) {
+				Observer *x = fifo;
+				fifo = fifo->next;
+				(*x)(val);
+			}
+		}
+
+		///Calls all observers, the last observer receives the value as rvalue
+		/** Used when the value is not stored, so the last observer is its sole consumer */
+		void notifyObserversMove(T &val) {
+			Observer *fifo = closeObservers();
+			while (fifo) {
+				Observer *x = fifo;
+				fifo = fifo->next;
+				if (fifo) (*x)(static_cast<const T &>(val));
+				else (*x)(std::move(val));
+			}
+		}
 
 	};
 
@@ -441,27 +728,35 @@ template<typename T> class Future {
 	public:
 		AlertObserver(const AlertFn &alert) :alert(alert),alerted(false) {}
 		virtual void operator()(const T &) throw() {
-			alerted = true;
-			alert();
+			notify();
 		}
 		virtual void operator()(const std::exception_ptr &) throw() {
-			alerted = true;
-			alert();
+			notify();
 		}
 		AlertFn alert;
-		bool alerted;
+		std::atomic<bool> alerted;
+	protected:
+		void notify() {
+			//the observer can be destroyed once the flag is set, so keep alert in local variable
+			AlertFn a(alert);
+			alerted.store(true, std::memory_order_release);
+			a();
+		}
 	};
 
 	///Wait for resolving
 	/**
 	 Function waits for infinite period until future is resolved 
+
+	 When called in a thread of a thread pool, the thread processes other functions of the pool
+	 while it is waiting (see yieldOrHalt())
 	 */
 	void wait() const {
 		if (!isResolved()) {
 			AlertObserver obs(AlertFn::thisThread());
 			addObserver(&obs);
 			while (!obs.alerted) {
-				halt();
+				yieldOrHalt();
 			}
 		}
 	}
@@ -469,7 +764,8 @@ template<typename T> class Future {
 	///Timeouted wait for resolving
 	/**
 	Function waits for specified timeout until future is resolved or timeout
-	expires which one comes the first
+	expires which one comes the first. Unlike wait(), the function doesn't process
+	functions of the thread pool, because they could exceed the timeout
 
 	@param specifies timeout
 	@retval true resolved
@@ -481,8 +777,9 @@ template<typename T> class Future {
 			addObserver(&obs);
 			while (!obs.alerted)
 				if (sleep(tm)) {
-					removeObserver(&obs);
-					return false;
+					if (removeObserver(&obs)) return false;
+					//observer is already being called, it must finish before it is destroyed
+					while (!obs.alerted) halt();
 				}
 		}
 		return true;
@@ -505,7 +802,7 @@ template<typename T> class Future {
 			if (v != nullptr) {
 				return *v;
 			} else {
-				throw CanceledPromise();
+				std::rethrow_exception(CanceledPromise::getExceptionPtr());
 			}
 		}
 	}
@@ -514,6 +811,28 @@ template<typename T> class Future {
 		return get();
 	}
 
+	///Moves the value out of the future
+	/** Function waits for resolution as get() does. Then it moves the value out of the future. This
+	 * allows to consume move-only types (for example std::unique_ptr). The value stored in the future
+	 * is left in moved-from state, so other holders of the same future should not access it.
+	 *
+	 * @return value of the future
+	 */
+	T take() {
+		wait();
+		std::exception_ptr e = value->getException();
+		if (e != nullptr) {
+			std::rethrow_exception(e);
+		} else {
+			T *v = value->getValue();
+			if (v != nullptr) {
+				return std::move(*v);
+			} else {
+				std::rethrow_exception(CanceledPromise::getExceptionPtr());
+			}
+		}
+	}
+
 	///Convert the future to ordinary value. The operator may block if the future is not ready yet.
 	/** To control the waiting, use Future::wait() before you receive the value */
 	operator const T &() const {
@@ -526,8 +845,8 @@ template<typename T> class Future {
 	*/
 	Future<T> isolate() const {
 		Future<T> res;
-		Promise<T> pres = res.getPromise();
-		pres.setValue(*this);
+		//forward the result through the observer, linking would share the state
+		value->addObserver(new typename Internal::ForwardObserver(res.value));
 		return res;
 	}
 
@@ -543,12 +862,7 @@ template<typename T> class Future {
 
 	*/
 	void cancel() {
-		try {
-			throw CanceledPromise();
-		}
-		catch (...) {
-			value->cancel(std::current_exception());
-		}
+		value->resolve(CanceledPromise::getExceptionPtr(), true);
 	}
 
 	///Futures are equal if they are shared from the same source
@@ -598,22 +912,22 @@ public:
 
 	}
 
+	///Resolves the promise by other future
+	/** The result of the future is forwarded to the promise. Once the promise is resolved by a future,
+	 * other attempts to resolve the promise directly are ignored.
+	 */
 	void setValue(const Future<T> &v) const {
-		Promise<T> me = *this;
-		class Observer: public AbstractPromiseObserver<T> {
-		public:
-			Promise<T> me;
-			Observer(const Promise<T> &me):me(me) {}
-			virtual void operator()(const T &value) throw() {
-				me.setValue(value);
-				delete this;
-			}
-			virtual void operator()(const std::exception_ptr &exception) throw() {
-				me.setException(exception);
-				delete this;
-			}
-		};
-		v.addObserver(new Observer(me));
+		value->resolveBy(v.value, false);
+	}
+
+	///Resolves the promise by other future, which is no longer used by the caller
+	/** If the future is pending and nobody else holds or observes it, it is linked with the promise, so
+	 * both share the result. This doesn't allocate and repeated resolving by futures (asynchronous loops)
+	 * doesn't create chains. Otherwise the result is forwarded. The variable is left empty
+	 */
+	void setValue(Future<T> &&v) const {
+		value->resolveBy(v.value, true);
+		v.value = nullptr;
 	}
 
 	
@@ -630,12 +944,12 @@ public:
 	///Sets exception to specified object
 	template<typename X>
 	void setException(const X &exp) const throw() {
-		try {
-			throw exp;
-		}
-		catch (...) {
-			value->resolve(std::current_exception());
-		}
+		value->resolve(std::make_exception_ptr(exp));
+	}
+
+	///Cancels the promise, the shared exception object is used
+	void setException(const CanceledPromise &) const throw() {
+		value->resolve(CanceledPromise::getExceptionPtr());
 	}
 
 	bool operator==(const Promise<T> &other) const {return value == other.value;}
@@ -649,178 +963,416 @@ protected:
 
 namespace _hlp {
 
-template<typename T, typename FnRet, typename Fn>
-class ChainValueObserver:public AbstractPromiseObserver<T> {
-public:
+	///Type passed to the next step of the chain. Handlers returning void (or exception) don't change the value
+	template<typename In, typename R> struct StageOut { typedef R T; };
+	template<typename In> struct StageOut<In, void> { typedef In T; };
+	template<typename In> struct StageOut<In, std::exception_ptr> { typedef In T; };
+
+	template<typename X> struct UnwrapFuture { typedef X T; };
+	template<typename X> struct UnwrapFuture<Future<X> > { typedef X T; };
+
+	///Passes result of a handler to the next step
+	template<typename R>
+	struct StageEmit {
+		template<typename Next, typename X>
+		static void emit(Next &next, X &&r) { next.value(std::forward<X>(r)); }
+	};
+	///Handler which returns exception_ptr resolves the chain by that exception
+	template<>
+	struct StageEmit<std::exception_ptr> {
+		template<typename Next>
+		static void emit(Next &next, const std::exception_ptr &e) { next.exception(e); }
+	};
 
-	typedef typename _hlp::FutureHandlerReturn<T,FnRet>::T ChRet;
+	///Step of the chain which calls handler with the value
+	/**
+	Steps are composed at compile time, each step receives the next step as the argument, so
+	whole chain is executed by single observer. Steps don't throw, exception thrown by the handler
+	is passed to the next step
+	*/
+	template<typename In, typename Fn, typename R>
+	class ValueStage {
+	public:
+		typedef typename StageOut<In, R>::T Out;
+		static const bool passThrough = false;
 
-	ChainValueObserver(const typename ChRet::PromiseT &promise, const Fn &fn)
-		:promise(promise),fn(fn) {}
+		ValueStage(const Fn &fn) :fn(fn) {}
 
-	virtual void operator()(const T &value) throw() {
-		try {
-			promise.setValue(fn(value));
-		} catch (...) {
-			promise.setException(std::current_exception());
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			try {
+				StageEmit<R>::emit(next, fn(std::forward<X>(v)));
+			} catch (...) {
+				next.exception(std::current_exception());
+			}
 		}
-		delete this;
-	}
-	virtual void operator()(const std::exception_ptr &exception) throw() {
-		promise.setException(exception);
-		delete this;
-	}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			next.exception(e);
+		}
+	protected:
+		Fn fn;
+	};
 
+	template<typename In, typename Fn>
+	class ValueStage<In, Fn, void> {
+	public:
+		typedef In Out;
+		static const bool passThrough = true;
 
-	static ChRet makeChain(const Future<T> &future, const Fn &fn) {
-		ChRet ret;
-		future.addObserver(new ChainValueObserver(ret.getPromise(), fn));
-		return std::move(ret);
-	}
+		ValueStage(const Fn &fn) :fn(fn) {}
 
-protected:
-	typename ChRet::PromiseT promise;
-	Fn fn;
-};
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			try {
+				fn(PassValue<In>::pass(v));
+			} catch (...) {
+				next.exception(std::current_exception());
+				return;
+			}
+			next.value(std::forward<X>(v));
+		}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			next.exception(e);
+		}
+	protected:
+		Fn fn;
+	};
 
-template<typename T, typename Fn>
-class ChainValueObserver<T,void,Fn>:public AbstractPromiseObserver<T> {
-public:
-	ChainValueObserver(const Fn &fn):fn(fn) {}
+	///Step of the chain which calls handler with the exception
+	template<typename In, typename Fn, typename R>
+	class ExceptionStage {
+	public:
+		typedef typename StageOut<In, R>::T Out;
+		static const bool passThrough = false;
 
-	virtual void operator()(const T &value) throw() {
-		fn(value);
-		delete this;
-	}
-	virtual void operator()(const std::exception_ptr &) throw() {
-		delete this;
-	}
+		ExceptionStage(const Fn &fn) :fn(fn) {}
 
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			next.value(std::forward<X>(v));
+		}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			try {
+				StageEmit<R>::emit(next, fn(e));
+			} catch (...) {
+				next.exception(std::current_exception());
+			}
+		}
+	protected:
+		Fn fn;
+	};
 
-	static const Future<T> &makeChain(const Future<T> &future, const Fn &fn) {
-		future.addObserver(new ChainValueObserver(fn));
-		return future;
-	}
+	template<typename In, typename Fn>
+	class ExceptionStage<In, Fn, void> {
+	public:
+		typedef In Out;
+		static const bool passThrough = true;
 
-protected:
-	Fn fn;
-};
+		ExceptionStage(const Fn &fn) :fn(fn) {}
 
-template<typename T, typename FnRet, typename Fn>
-class ChainExceptionObserver:public AbstractPromiseObserver<T> {
-public:
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			next.value(std::forward<X>(v));
+		}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			try {
+				fn(e);
+			} catch (...) {
+				next.exception(std::current_exception());
+				return;
+			}
+			next.exception(e);
+		}
+	protected:
+		Fn fn;
+	};
 
-	typedef typename _hlp::FutureHandlerReturn<T,FnRet>::T ChRet;
+	///Step of the chain which calls handler without arguments when the value is available
+	template<typename In, typename Fn, typename R>
+	class AnythingStage {
+	public:
+		typedef typename StageOut<In, R>::T Out;
+		static const bool passThrough = false;
 
-	ChainExceptionObserver(const typename ChRet::PromiseT &promise, const Fn &fn)
-		:promise(promise),fn(fn) {}
+		AnythingStage(const Fn &fn) :fn(fn) {}
 
-	virtual void operator()(const T &value) throw() {
-		try {
-			promise.setValue(value);
-		} catch (...) {
-			this->operator ()(std::current_exception());
+		template<typename X, typename Next>
+		void value(X &&, Next &next) {
+			try {
+				StageEmit<R>::emit(next, fn());
+			} catch (...) {
+				next.exception(std::current_exception());
+			}
 		}
-		delete this;
-	}
-	virtual void operator()(const std::exception_ptr &exception) throw() {
-		try {
-			promise.setValue(fn(exception));
-		} catch (...) {
-			promise.setException(std::current_exception());
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			next.exception(e);
 		}
-		delete this;
-	}
+	protected:
+		Fn fn;
+	};
 
+	template<typename In, typename Fn>
+	class AnythingStage<In, Fn, void> {
+	public:
+		typedef In Out;
+		static const bool passThrough = true;
 
-	static ChRet makeChain(const Future<T> &future, const Fn &fn) {
-		ChRet ret;
-		future.addObserver(new ChainExceptionObserver(ret.getPromise(), fn));
-		return std::move(ret);
-	}
+		AnythingStage(const Fn &fn) :fn(fn) {}
 
-protected:
-	typename ChRet::PromiseT promise;
-	Fn fn;
-};
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			try {
+				fn();
+			} catch (...) {
+				next.exception(std::current_exception());
+				return;
+			}
+			next.value(std::forward<X>(v));
+		}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			next.exception(e);
+		}
+	protected:
+		Fn fn;
+	};
 
-template<typename T, typename Fn>
-class ChainExceptionObserver<T,void,Fn>:public AbstractPromiseObserver<T> {
-public:
-	ChainExceptionObserver(const Fn &fn):fn(fn) {}
+	///Composition of two steps
+	template<typename A, typename B>
+	class ComposedStage {
+	public:
+		typedef typename B::Out Out;
+		static const bool passThrough = A::passThrough && B::passThrough;
 
-	virtual void operator()(const T &) throw() {
-		delete this;
-	}
-	virtual void operator()(const std::exception_ptr &ptr) throw() {
-		fn(ptr);
-		delete this;
-	}
+		ComposedStage(A &&a, B &&b) :a(std::move(a)), b(std::move(b)) {}
 
-	static const Future<T> &makeChain(const Future<T> &future, const Fn &fn) {
-		future.addObserver(new ChainExceptionObserver(fn));
-		return future;
-	}
+		template<typename Next>
+		class Link {
+		public:
+			Link(B &b, Next &next) :b(b), next(next) {}
+			template<typename X>
+			void value(X &&v) { b.value(std::forward<X>(v), next); }
+			void exception(const std::exception_ptr &e) { b.exception(e, next); }
+		protected:
+			B &b;
+			Next &next;
+		};
 
-protected:
-	Fn fn;
-};
+		template<typename X, typename Next>
+		void value(X &&v, Next &next) {
+			Link<Next> l(b, next);
+			a.value(std::forward<X>(v), l);
+		}
+		template<typename Next>
+		void exception(const std::exception_ptr &e, Next &next) {
+			Link<Next> l(b, next);
+			a.exception(e, l);
+		}
+	protected:
+		A a;
+		B b;
+	};
 
-template<typename T, typename FnRet, typename Fn>
-class ChainAnythingObserver:public AbstractPromiseObserver<T> {
-public:
+	template<typename In, typename Fn> using ValueStageFor = ValueStage<In, Fn, typename std::result_of<Fn(In)>::type>;
+	template<typename In, typename Fn> using ExceptionStageFor = ExceptionStage<In, Fn, typename std::result_of<Fn(std::exception_ptr)>::type>;
+	template<typename In, typename Fn> using AnythingStageFor = AnythingStage<In, Fn, typename std::result_of<Fn()>::type>;
+	template<typename In> using AlertStage = AnythingStage<In, AlertFn, void>;
 
-	typedef typename _hlp::FutureHandlerReturn<T,FnRet>::T ChRet;
+	///End of the chain which resolves the promise
+	template<typename T>
+	class PromiseSink {
+	public:
+		PromiseSink(const Promise<T> &promise) :promise(promise) {}
+		template<typename X>
+		void value(X &&v) { promise.setValue(std::forward<X>(v)); }
+		void exception(const std::exception_ptr &e) { promise.setException(e); }
+	protected:
+		Promise<T> promise;
+	};
+
+	///End of the chain when nobody is interested in the result
+	class NullSink {
+	public:
+		template<typename X>
+		void value(X &&) {}
+		void exception(const std::exception_ptr &) {}
+	};
 
-	ChainAnythingObserver(const typename ChRet::PromiseT &promise, const Fn &fn)
-		:promise(promise),fn(fn) {}
+	///Single observer which executes all steps of the chain
+	template<typename T, typename Stage, typename Sink>
+	class ChainObserver : public AbstractPromiseObserver<T>, public PoolAlloc {
+	public:
+		ChainObserver(Stage &&stage, Sink &&sink) :stage(std::move(stage)), sink(std::move(sink)) {}
 
-	virtual void operator()(const T &) throw() {
-		try {
-			promise.setValue(fn());
-		} catch (...) {
-			this->operator ()(std::current_exception());
+		virtual void operator()(const T &value) throw() {
+			stage.value(PassValue<T>::pass(value), sink);
+			delete this;
+		}
+		virtual void operator()(T &&value) throw() {
+			stage.value(std::move(value), sink);
+			delete this;
 		}
-		delete this;
+		virtual void operator()(const std::exception_ptr &exception) throw() {
+			stage.exception(exception, sink);
+			delete this;
+		}
+
+	protected:
+		Stage stage;
+		Sink sink;
+
+		template<typename, typename> friend class yasync::FutureChain;
+	};
+
+	template<typename T, typename Stage, typename Out = typename Stage::Out>
+	struct ChainReturn;
+
+	///Retrieves type of the future produced by the expression
+	template<typename X> struct ChainFuture { typedef X T; };
+	template<typename X> struct ChainFuture<const X &> { typedef X T; };
+	template<typename X, typename Stage> struct ChainFuture<FutureChain<X, Stage> > {
+		typedef Future<typename FutureChain<X, Stage>::Type> T;
+	};
+}
+
+///Chain of handlers connected to the future
+/** The object is result of the operator >>. It is the Future of the result of the chain. The handler
+ * is connected to the source future immediately, so it is called once the source future is resolved,
+ * regardless on whether the object is stored in a variable.
+ *
+ * When the handler is appended to a temporary chain, it is fused with the previous handlers. Handlers
+ * are composed at compile time and the composed chain replaces the observer connected to the source
+ * future, so the whole chain is executed by single observer. Intermediate results are passed directly
+ * from one handler to other and no intermediate Future is allocated. If the previous handlers are already
+ * running or finished, the handler is connected to the result of the chain as a standalone step.
+ *
+ * @code
+ * Future<std::string> r = f >> [](int x) { return x + 1; } >> [](int x) { return std::to_string(x); };
+ * @endcode
+ *
+ * If the chain contains only handlers returning void, the result is the source future and
+ * no extra Future is allocated. Handler returning a Future is not fused with the following handlers,
+ * because its result is not available synchronously. Such handler finishes the chain and the
+ * operator returns the Future.
+ */
+template<typename T, typename Stage>
+class FutureChain: public Future<typename _hlp::UnwrapFuture<typename Stage::Out>::T> {
+public:
+	typedef typename _hlp::UnwrapFuture<typename Stage::Out>::T Type;
+	typedef Future<Type> FutureT;
+	typedef Promise<Type> PromiseT;
+
+	///Connects the chain to the source future
+	FutureChain(const Future<T> &source, Stage &&stage)
+		:FutureT(nullptr), source(source), obs(nullptr) {
+		connect(std::move(stage), SourceResult());
 	}
-	virtual void operator()(const std::exception_ptr &exception) throw() {
-		promise.setException(exception);
-		delete this;
+	FutureChain(FutureChain &&other)
+		:FutureT(std::move(other)), source(std::move(other.source)), obs(other.obs) {
+		other.obs = nullptr;
+	}
+	///Copy of the chain is ordinary future, handlers appended to the copy are not fused
+	FutureChain(const FutureChain &other)
+		:FutureT(other), source(other.source), obs(nullptr) {}
+	FutureChain &operator=(const FutureChain &other) = delete;
+
+	///Retrieves result of the chain
+	const FutureT &getFuture() const {
+		return *this;
 	}
 
-	static ChRet makeChain(const Future<T> &future, const Fn &fn) {
-		ChRet ret;
-		future.addObserver(new ChainAnythingObserver(ret.getPromise(), fn));
-		return std::move(ret);
+	///Appends next step to the chain. The current object is detached from the chain
+	template<typename Next>
+	FutureChain<T, _hlp::ComposedStage<Stage, Next> > append(Next &&next) {
+		typedef FutureChain<T, _hlp::ComposedStage<Stage, Next> > Result;
+		Observer *o = obs;
+		obs = nullptr;
+		//the observer can't be replaced, when it is already running or finished, or when
+		//the intermediate result is visible to other variables
+		if (o == nullptr || !(SourceResult::value || this->value->isExclusive()) || !source.removeObserver(o)) {
+			return Result(source, FutureChain<Type, Next>(*this, std::move(next)));
+		}
+		Result res(source, _hlp::ComposedStage<Stage, Next>(std::move(o->stage), std::move(next)),
+				static_cast<FutureT &>(*this), std::move(o->sink));
+		delete o;
+		return res;
 	}
 
 protected:
-	typename ChRet::PromiseT promise;
-	Fn fn;
-};
-
-template<typename T, typename Fn>
-class ChainAnythingObserver<T,void,Fn>:public AbstractPromiseObserver<T> {
-public:
-	ChainAnythingObserver(const Fn &fn):fn(fn) {}
+	///The chain doesn't change the value, so the result is the source future
+	typedef std::integral_constant<bool, Stage::passThrough && std::is_same<Type, T>::value> SourceResult;
+	typedef typename std::conditional<SourceResult::value, _hlp::NullSink, _hlp::PromiseSink<Type> >::type Sink;
+	typedef _hlp::ChainObserver<T, Stage, Sink> Observer;
+
+	Future<T> source;
+	///Observer connected to the source. It can be replaced until it is called
+	Observer *obs;
+
+	template<typename, typename> friend class FutureChain;
+
+	///Constructs the chain, which continues by a standalone step
+	FutureChain(const Future<T> &source, const FutureT &result)
+		:FutureT(result), source(source), obs(nullptr) {}
+
+	///Constructs the chain, which replaces the previous chain
+	template<typename PrevFuture, typename PrevSink>
+	FutureChain(const Future<T> &source, Stage &&stage, PrevFuture &prev, PrevSink &&prevSink)
+		:FutureT(nullptr), source(source), obs(nullptr) {
+		reconnect(std::move(stage), prev, std::move(prevSink));
+	}
 
-	virtual void operator()(const T &) throw() {
-		fn();
-		delete this;
+	void connect(Stage &&stage, std::true_type) {
+		FutureT::operator=(source);
+		obs = new Observer(std::move(stage), _hlp::NullSink());
+		source.addObserver(obs);
 	}
-	virtual void operator()(const std::exception_ptr &ptr) throw() {
-		delete this;
+	void connect(Stage &&stage, std::false_type) {
+		FutureT::operator=(FutureT());
+		obs = new Observer(std::move(stage), _hlp::PromiseSink<Type>(this->getPromise()));
+		source.addObserver(obs);
 	}
 
-	static const Future<T> &makeChain(const Future<T> &future, const Fn &fn) {
-		future.addObserver(new ChainAnythingObserver(fn));
-		return future;
+	///Result of the previous chain has the same type, so it is reused
+	void reconnect(Stage &&stage, FutureT &prev, Sink &&prevSink) {
+		FutureT::operator=(std::move(prev));
+		obs = new Observer(std::move(stage), std::move(prevSink));
+		source.addObserver(obs);
+	}
+	///Result of the previous chain is dropped, nobody else can see it
+	template<typename PrevFuture, typename PrevSink>
+	void reconnect(Stage &&stage, PrevFuture &, PrevSink &&) {
+		connect(std::move(stage), SourceResult());
 	}
-
-protected:
-	Fn fn;
 };
 
+namespace _hlp {
+
+	///Creates the result of the operator >>. The chain stays open unless the last handler returned a Future
+	template<typename T, typename Stage, typename Out>
+	struct ChainReturn {
+		typedef FutureChain<T, Stage> Result;
+		static Result make(FutureChain<T, Stage> &&chain) { return std::move(chain); }
+	};
+	template<typename T, typename Stage, typename X>
+	struct ChainReturn<T, Stage, Future<X> > {
+		typedef Future<X> Result;
+		static Result make(FutureChain<T, Stage> &&chain) { return chain.getFuture(); }
+	};
+
+	template<typename T, typename Stage>
+	typename ChainReturn<T, Stage>::Result makeChain(const Future<T> &future, Stage &&stage) {
+		return ChainReturn<T, Stage>::make(FutureChain<T, Stage>(future, std::move(stage)));
+	}
+
+	template<typename T, typename S, typename Stage>
+	typename ChainReturn<T, ComposedStage<S, Stage> >::Result appendChain(FutureChain<T, S> &chain, Stage &&stage) {
+		return ChainReturn<T, ComposedStage<S, Stage> >::make(chain.append(std::move(stage)));
+	}
 }
 
 
@@ -829,38 +1381,35 @@ protected:
 	* @param future future which is going to be resolved
 	* @param fn function, which accepts the argument T (type of the future). The function can return value of
 	*  the same type, other type, void or Future of any type. The function can also throw an exception, which
-	*  is caught and used to resolve the returned Future
+	*  is caught and passed to the rest of the chain
 	*
-	* @return Depends on return value of the function. It is generally Future<X> where X is type of return value of the
-	* function fn. In case, that fn has no return value, result is Future<T>, because the function doesn't produces
-	* the result, source result is used instead.
+	* @return Depends on return value of the function. It is generally FutureChain which can be converted to Future<X>,
+	* where X is type of return value of the function fn. In case, that fn has no return value, the chain
+	* carries the source value. If the function returns Future<X>, result is Future<X>
 	*
 	* @note function is not called when the future is resolved by an exception
 	*/
 template<typename T, typename Fn>
-auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::FutureHandlerReturn<T, typename std::result_of<Fn(T)>::type >::T {
-	typedef typename std::result_of<Fn(T)>::type FnRet;
-	return _hlp::ChainValueObserver<T, FnRet, Fn>::makeChain(future, fn);
+auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::ValueStageFor<T, Fn> >::Result {
+	return _hlp::makeChain(future, _hlp::ValueStageFor<T, Fn>(fn));
 }
 ///Define exception handler, which is called when the future is resolved using an exception.
 /**
  * @param future future which is going to be resolved
- * @param fn function, which accepts the argument T (type of the future). The function can return value of
+ * @param fn function, which accepts std::exception_ptr. The function can return value of
  *  the same type, other type, void or Future of any type. The function can also throw an exception, which
- *  is caught and used to resolve the returned Future
+ *  is caught and passed to the rest of the chain
  *
- * @return Depends on return value of the function. It is generally Future<X> where X is type of return value of the
- * function fn. In case, that fn has no return value, result is Future<T>, because the function doesn't produces
- * the result, source result is used instead.
+ * @return Depends on return value of the function. It is generally FutureChain which can be converted to Future<X>,
+ * where X is type of return value of the function fn. In case, that fn has no return value, the chain
+ * carries the source result.
  *
- * 	 * @note function is not called when the future is resolved by a value
+ * @note function is not called when the future is resolved by a value
  *
  */
-
 template<typename T, typename Fn>
-auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::FutureHandlerReturn<T, typename std::result_of<Fn(std::exception_ptr)>::type >::T {
-	typedef typename std::result_of<Fn(std::exception_ptr)>::type  FnRet;
-	return _hlp::ChainExceptionObserver<T, FnRet, Fn>::makeChain(future,fn);
+auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::ExceptionStageFor<T, Fn> >::Result {
+	return _hlp::makeChain(future, _hlp::ExceptionStageFor<T, Fn>(fn));
 }
 
 ///Define a function without arguments, which is called when future is resolved
@@ -872,24 +1421,51 @@ auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::Futur
  * This variation is equivalent to have function with argument which is ignored however, using lambdas
  * without arguments is much convenient.
  *
- * @return Depends on return value of the function. It is generally Future<X> where X is type of return value of the
- * function fn. In case, that fn has no return value, result is Future<T>, because the function doesn't produces
- * the result, source result is used instead.
+ * @return Depends on return value of the function. It is generally FutureChain which can be converted to Future<X>,
+ * where X is type of return value of the function fn. In case, that fn has no return value, the chain
+ * carries the source value.
  */
 template<typename T, typename Fn>
-auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::FutureHandlerReturn<T, typename std::result_of<Fn()>::type >::T {
-	typedef typename std::result_of<Fn()>::type  FnRet;
-	return _hlp::ChainAnythingObserver<T, FnRet, Fn>::makeChain(future,fn);
+auto operator >> (const Future<T> &future, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::AnythingStageFor<T, Fn> >::Result {
+	return _hlp::makeChain(future, _hlp::AnythingStageFor<T, Fn>(fn));
 }
 
 template<typename T>
-Future<T> operator >> (const Future<T> &future, const AlertFn &fn) {
-	return _hlp::ChainAnythingObserver<T, void, AlertFn>::makeChain(future, fn);
+FutureChain<T, _hlp::AlertStage<T> > operator >> (const Future<T> &future, const AlertFn &fn) {
+	return _hlp::makeChain(future, _hlp::AlertStage<T>(fn));
 }
 
 template<typename T>
-Future<T> operator >> (const Future<T> &future, const Checkpoint &fn) {
-	return _hlp::ChainAnythingObserver<T, void, Checkpoint>::makeChain(future, fn);
+FutureChain<T, _hlp::AlertStage<T> > operator >> (const Future<T> &future, const Checkpoint &fn) {
+	return _hlp::makeChain(future, _hlp::AlertStage<T>(fn));
+}
+
+///Appends the function to the chain
+template<typename T, typename S, typename Fn>
+auto operator >> (FutureChain<T, S> &&chain, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::ComposedStage<S, _hlp::ValueStageFor<typename S::Out, Fn> > >::Result {
+	return _hlp::appendChain(chain, _hlp::ValueStageFor<typename S::Out, Fn>(fn));
+}
+
+///Appends the exception handler to the chain
+template<typename T, typename S, typename Fn>
+auto operator >> (FutureChain<T, S> &&chain, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::ComposedStage<S, _hlp::ExceptionStageFor<typename S::Out, Fn> > >::Result {
+	return _hlp::appendChain(chain, _hlp::ExceptionStageFor<typename S::Out, Fn>(fn));
+}
+
+///Appends the function without arguments to the chain
+template<typename T, typename S, typename Fn>
+auto operator >> (FutureChain<T, S> &&chain, const Fn &fn) -> typename _hlp::ChainReturn<T, _hlp::ComposedStage<S, _hlp::AnythingStageFor<typename S::Out, Fn> > >::Result {
+	return _hlp::appendChain(chain, _hlp::AnythingStageFor<typename S::Out, Fn>(fn));
+}
+
+template<typename T, typename S>
+FutureChain<T, _hlp::ComposedStage<S, _hlp::AlertStage<typename S::Out> > > operator >> (FutureChain<T, S> &&chain, const AlertFn &fn) {
+	return _hlp::appendChain(chain, _hlp::AlertStage<typename S::Out>(fn));
+}
+
+template<typename T, typename S>
+FutureChain<T, _hlp::ComposedStage<S, _hlp::AlertStage<typename S::Out> > > operator >> (FutureChain<T, S> &&chain, const Checkpoint &fn) {
+	return _hlp::appendChain(chain, _hlp::AlertStage<typename S::Out>(fn));
 }
 
 
@@ -898,23 +1474,58 @@ inline Promise<T> Future<T>::getPromise() const {
 	return Promise<T>(value);
 }
 
-///Handles operator >> with return value through the future		
+///Dispatched function which returns a value, the value resolves the returned future
 template<typename Fn, typename RetV>
-struct RunThreadFn {
-	typedef Future<RetV> ReturnType;
-	static Future<RetV> runThread(const Fn &fn) {
-		Future<RetV> f;
-		Promise<RetV> p = f.getPromise();
-		std::thread t([p, fn] {
+class DispatchedFunction {
+public:
+	typedef typename _hlp::FutureHandlerReturn<Void, RetV >::T RetT;
+
+	template<typename X>
+	static RetT dispatch(AbstractDispatcher *disp, X &&fn) {
+		RetT f;
+		disp->dispatch(new Task(Call(std::forward<X>(fn), f.getPromise())));
+		return f;
+	}
+
+protected:
+	///Calls the function and resolves the promise by its result
+	class Call {
+	public:
+		template<typename X>
+		Call(X &&fn, const Promise<typename RetT::Type> &p) :fn(std::forward<X>(fn)), p(p) {}
+		void operator()() {
 			try {
 				p.setValue(fn());
 			}
 			catch (...) {
 				p.setException(std::current_exception());
 			}
-		});
-		t.detach();
-		return f;
+		}
+		///Resolves the promise when the function missed its deadline
+		void expired() {
+			p.setException(DeadlineExceeded::getExceptionPtr());
+		}
+	protected:
+		Fn fn;
+		Promise<typename RetT::Type> p;
+	};
+
+	class Task: public DispatchedFunction<Call,void> {
+	public:
+		Task(Call &&call):DispatchedFunction<Call,void>(std::move(call)) {}
+		virtual void expired() throw() {
+			this->fn.expired();
+		}
+	};
+};
+
+///Handles operator >> with return value through the future
+template<typename Fn, typename RetV>
+struct RunThreadFn {
+	typedef typename DispatchedFunction<Fn, RetV>::RetT ReturnType;
+	template<typename X>
+	static ReturnType runThread(X &&fn) {
+		return DispatchFn::newThread() >> std::forward<X>(fn);
 	}
 };
 
@@ -18,13 +18,8 @@ namespace yasync {
 				x.processed = true;
 			}
 			~SafeDispatchFutureValue() {
-				try {
-					if (!processed) {
-						throw CanceledPromise();
-					}
-				}
-				catch (...) {
-					promise.setException(std::current_exception());
+				if (!processed) {
+					promise.setException(CanceledPromise::getExceptionPtr());
 				}
 			}
 			void operator()() const {
@@ -45,13 +40,8 @@ namespace yasync {
 				x.processed = true;
 			}
 			~SafeDispatchFutureException() {
-				try {
-					if (!processed) {
-						throw CanceledPromise();
-					}
-				}
-				catch (...) {
-					promise.setException(std::current_exception());
+				if (!processed) {
+					promise.setException(CanceledPromise::getExceptionPtr());
 				}
 			}
 			void operator()() const {
@@ -64,6 +54,24 @@ namespace yasync {
 			bool processed;
 		};
 
+		///Carries the value to the dispatcher and resolves the promise there
+		/** The value is moved into the dispatched function and then moved into the promise, so
+		 * it is not copied during dispatching. If the dispatcher rejects the function, the promise
+		 * is canceled by destruction */
+		template<typename T>
+		class DispatchedValue : public AbstractDispatchedFunction {
+		public:
+			template<typename X>
+			DispatchedValue(const Promise<T> &promise, X &&value) :promise(promise), value(std::forward<X>(value)) {}
+
+			virtual void run() throw() {
+				promise.setValue(std::move(value));
+			}
+		protected:
+			Promise<T> promise;
+			T value;
+		};
+
 		template<typename T>
 		class DispatchObserver : public AbstractPromiseObserver<T> {
 		public:
@@ -101,19 +109,19 @@ namespace yasync {
 	class DispatchedFuture {
 
 	protected:
-		class Observer : public AbstractPromiseObserver<Initial>
+		class Observer : public AbstractPromiseObserver<Initial>, public PoolAlloc
 		{
 		public:
 			Observer(const Promise<Initial> &target, const DispatchFn &dispatcher)
 				:target(target), dispatcher(dispatcher) {}
 
 			virtual void operator()(const Initial &value) throw() {
-
-				Promise<Initial> f(target);
-				Initial v(value);
-				dispatcher >> [f, v] { f.setValue(v); };
+				dispatcher >> AbstractDispatcher::Fn(new _hlp::DispatchedValue<Initial>(target, _hlp::PassValue<Initial>::pass(value)));
+				delete this;
+			}
+			virtual void operator()(Initial &&value) throw() {
+				dispatcher >> AbstractDispatcher::Fn(new _hlp::DispatchedValue<Initial>(target, std::move(value)));
 				delete this;
-
 			}
 			virtual void operator()(const std::exception_ptr &exception) throw() {
 				Promise<Initial> p(target);
@@ -174,7 +182,7 @@ namespace yasync {
 
 //		static Final fakeFinalVal;
 
-		template<typename X> using FutX = decltype(Final() >> (*(X *)nullptr));
+		template<typename X> using FutX = typename _hlp::ChainFuture<decltype(Final() >> (*(X *)nullptr))>::T;
 
 		template<typename Fn>
 		DispatchedFuture<Initial, FutX<Fn> > operator >> (const Fn &fn)   {
@@ -302,28 +310,6 @@ namespace yasync {
 	}
 
 
-	template<typename Fn, typename RetV> 
-	class DispatchedFunction {
-	public:
-		typedef typename _hlp::FutureHandlerReturn<Void, RetV >::T RetT;
-
-		static RetT dispatch(AbstractDispatcher *disp, const Fn &fn) {
-			RetT f;
-			auto p = f.getPromise();
-			auto fnx = [fn,p] {
-				try {
-					p.setValue(fn());
-				}
-				catch (...) {
-					p.setException(std::current_exception());
-				}
-			};
-			disp->dispatch(new DispatchedFunction<decltype(fnx),void>(fnx));
-			return f;
-		}
-	};
-
-
 	template<typename T>
 	DispatchedFuture<T> operator >> (const Future<T> &future, _XNewThread) {
 		return future >> DispatchFn::newThread();
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <atomic>
+#include <iterator>
+#include <new>
+#include <utility>
+#include <vector>
+#include "future.h"
+
+namespace yasync {
+
+	namespace _hlp {
+
+		///Shared state of the join operation.
+		/** The state and all observers (slots) are allocated as single block. Each slot is observer
+		 * of one joined future. The block is destroyed when the last slot is called or detached
+		 *
+		 * @tparam T type of joined futures
+		 * @tparam Impl implementation (CRTP) which handles onValue and onException
+		 */
+		template<typename T, typename Impl>
+		class JoinState {
+		public:
+
+			class Slot : public AbstractPromiseObserver<T> {
+			public:
+				Slot(Impl *owner, std::size_t index) :owner(owner), index(index), source(nullptr), hasValue(false), attached(false) {}
+				~Slot() {
+					if (hasValue) getValue().~T();
+				}
+
+				virtual void operator()(const T &value) throw() {
+					owner->onValue(*this, PassValue<T>::pass(value));
+				}
+				virtual void operator()(T &&value) throw() {
+					owner->onValue(*this, std::move(value));
+				}
+				virtual void operator()(const std::exception_ptr &exception) throw() {
+					owner->onException(*this, exception);
+				}
+
+				T &getValue() { return *reinterpret_cast<T *>(&value); }
+
+				template<typename X>
+				void storeValue(X &&v) {
+					new(&value) T(std::forward<X>(v));
+					hasValue = true;
+				}
+
+				Impl *owner;
+				std::size_t index;
+				Future<T> source;
+				typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type value;
+				bool hasValue;
+				///the slot was registered to its future by connect()
+				std::atomic<bool> attached;
+			};
+
+			///Allocates the state and the slots in single block
+			template<typename Iter>
+			static Impl *create(Iter begin, std::size_t count) {
+				std::size_t offset = slotOffset();
+				void *p = ::operator new(offset + sizeof(Slot) * count);
+				Impl *st = new(p) Impl(count);
+				st->slots = reinterpret_cast<Slot *>(reinterpret_cast<char *>(p) + offset);
+				for (std::size_t i = 0; i < count; ++i, ++begin) {
+					Slot *s = new(st->slots + i) Slot(st, i);
+					s->source = *begin;
+				}
+				return st;
+			}
+
+			///Registers all slots to its futures. The function consumes the reference held by the caller
+			void connect() {
+				for (std::size_t i = 0; i < count; ++i) {
+					Slot &s = slots[i];
+					if (static_cast<Impl *>(this)->isDone()) release();
+					else {
+						//resolved future calls the slot inside of addObserver()
+						s.source.addObserver(&s);
+						s.attached.store(true, std::memory_order_release);
+					}
+				}
+				release();
+			}
+
+		protected:
+
+			JoinState(std::size_t count) :count(count), slots(nullptr), remain(count + 1) {}
+
+			std::size_t count;
+			Slot *slots;
+			///count of slots which were not called yet, plus one reference for connect()
+			std::atomic<std::size_t> remain;
+
+			static std::size_t slotOffset() {
+				std::size_t a = std::alignment_of<Slot>::value;
+				return (sizeof(Impl) + a - 1) / a * a;
+			}
+
+			///Called when a slot is finished. The last call destroys the block
+			void release() {
+				if (--remain == 0) {
+					static_cast<Impl *>(this)->onFinish();
+					for (std::size_t i = 0; i < count; ++i) slots[i].~Slot();
+					Impl *me = static_cast<Impl *>(this);
+					me->~Impl();
+					::operator delete(me);
+				}
+			}
+		};
+
+		template<typename T>
+		class WhenAllState : public JoinState<T, WhenAllState<T> > {
+			typedef JoinState<T, WhenAllState<T> > Super;
+		public:
+			typedef typename Super::Slot Slot;
+
+			WhenAllState(std::size_t count) :Super(count), failed(false) {}
+
+			template<typename X>
+			void onValue(Slot &s, X &&value) {
+				try {
+					s.storeValue(std::forward<X>(value));
+				}
+				catch (...) {
+					onException(s, std::current_exception());
+					return;
+				}
+				this->release();
+			}
+			void onException(Slot &, const std::exception_ptr &exception) {
+				//first exception resolves the result, the state is kept until all futures are resolved
+				if (!failed.exchange(true)) promise.setException(exception);
+				this->release();
+			}
+			bool isDone() const {
+				return failed.load(std::memory_order_relaxed);
+			}
+			void onFinish() {
+				if (failed) return;
+				try {
+					std::vector<T> res;
+					res.reserve(this->count);
+					for (std::size_t i = 0; i < this->count; ++i) {
+						res.push_back(std::move(this->slots[i].getValue()));
+					}
+					promise.setValue(std::move(res));
+				}
+				catch (...) {
+					promise.setException(std::current_exception());
+				}
+			}
+
+			Promise<std::vector<T> > promise;
+		protected:
+			std::atomic<bool> failed;
+		};
+
+		template<typename T>
+		class WhenAnyState : public JoinState<T, WhenAnyState<T> > {
+			typedef JoinState<T, WhenAnyState<T> > Super;
+		public:
+			typedef typename Super::Slot Slot;
+
+			WhenAnyState(std::size_t count) :Super(count), done(false) {}
+
+			template<typename X>
+			void onValue(Slot &s, X &&value) {
+				if (!done.exchange(true)) {
+					promise.setValue(std::pair<std::size_t, T>(s.index, std::forward<X>(value)));
+					detachOthers(s);
+				}
+				this->release();
+			}
+			void onException(Slot &s, const std::exception_ptr &exception) {
+				if (!done.exchange(true)) {
+					promise.setException(exception);
+					detachOthers(s);
+				}
+				this->release();
+			}
+			bool isDone() const {
+				return done.load(std::memory_order_relaxed);
+			}
+			void onFinish() {}
+
+			Promise<std::pair<std::size_t, T> > promise;
+
+		protected:
+			std::atomic<bool> done;
+
+			///Removes observers from futures which are still pending
+			/** Slots which are already being called are released by themselves. Slots which
+			 * are not attached yet are released by connect() */
+			void detachOthers(Slot &winner) {
+				for (std::size_t i = 0; i < this->count; ++i) {
+					Slot &s = this->slots[i];
+					if (&s != &winner && s.attached.load(std::memory_order_acquire)
+							&& s.source.removeObserver(&s)) this->release();
+				}
+			}
+		};
+
+	}
+
+	///Creates future which is resolved when all futures in the range are resolved
+	/**
+	 * @param begin iterator to the first future
+	 * @param end iterator after the last future
+	 * @return future resolved by vector of values in the same order as the futures in the range. If any
+	 * future is resolved by an exception, the returned future is resolved by the first exception immediately
+	 *
+	 * @note All futures are joined by single allocated block which contains atomic counter and a slot
+	 * for each future.
+	 */
+	template<typename Iter>
+	Future<std::vector<typename std::iterator_traits<Iter>::value_type::Type> > whenAll(Iter begin, Iter end) {
+		typedef typename std::iterator_traits<Iter>::value_type::Type T;
+		typedef _hlp::WhenAllState<T> State;
+		Future<std::vector<T> > res;
+		std::size_t count = std::distance(begin, end);
+		if (count == 0) {
+			res.getPromise().setValue(std::vector<T>());
+		} else {
+			State *st = State::create(begin, count);
+			st->promise = res.getPromise();
+			st->connect();
+		}
+		return res;
+	}
+
+	///Creates future which is resolved by the first resolved future in the range
+	/**
+	 * @param begin iterator to the first future
+	 * @param end iterator after the last future
+	 * @return future resolved by pair, where the first item is index of the future in the range, and the second item is
+	 * its value. If the first resolved future is resolved by an exception, the returned future is resolved by that
+	 * exception. Remaining futures are detached, so they can be dropped without calling any handler. Empty range
+	 * results to canceled future.
+	 */
+	template<typename Iter>
+	Future<std::pair<std::size_t, typename std::iterator_traits<Iter>::value_type::Type> > whenAny(Iter begin, Iter end) {
+		typedef typename std::iterator_traits<Iter>::value_type::Type T;
+		typedef _hlp::WhenAnyState<T> State;
+		Future<std::pair<std::size_t, T> > res;
+		std::size_t count = std::distance(begin, end);
+		if (count != 0) {
+			State *st = State::create(begin, count);
+			st->promise = res.getPromise();
+			st->connect();
+		} else {
+			//touch the promise, its destruction cancels the future
+			res.getPromise();
+		}
+		return res;
+	}
+
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "future.h"
+
+namespace yasync {
+
+	namespace _hlp {
+
+		///State of the asynchronous loop
+		/** The loop object is observer of the future returned by the current iteration. If the
+		 * future is already resolved, the next iteration runs in the same cycle, so the stack
+		 * doesn't grow. Otherwise the loop continues in the thread which resolves the future.
+		 * The object is destroyed once the loop finishes
+		 */
+		template<typename T, typename Cond, typename Body>
+		class AsyncLoop : public AbstractPromiseObserver<T>, public PoolAlloc {
+		public:
+			AsyncLoop(const Cond &cond, const Body &body, const Promise<T> &promise)
+				:cond(cond), body(body), promise(promise), current(nullptr) {}
+
+			void run(T v) throw() {
+				try {
+					while (cond(static_cast<const T &>(v))) {
+						current = body(static_cast<const T &>(v));
+						//pending - the loop continues in the observer
+						if (current.addObserverIfPending(this)) return;
+						v = PassValue<T>::pass(current.get());
+					}
+				} catch (...) {
+					promise.setException(std::current_exception());
+					delete this;
+					return;
+				}
+				promise.setValue(std::move(v));
+				delete this;
+			}
+
+			virtual void operator()(const T &value) throw() {
+				run(PassValue<T>::pass(value));
+			}
+			virtual void operator()(T &&value) throw() {
+				run(std::move(value));
+			}
+			virtual void operator()(const std::exception_ptr &exception) throw() {
+				promise.setException(exception);
+				delete this;
+			}
+
+		protected:
+			Cond cond;
+			Body body;
+			Promise<T> promise;
+			Future<T> current;
+		};
+
+	}
+
+	///Runs asynchronous loop
+	/**
+	 * @param init initial state of the loop
+	 * @param cond function bool(const T &) which is called before each iteration. The loop continues
+	 *  while the function returns true
+	 * @param body function Future<T>(const T &) which performs single iteration. Result of the
+	 *  iteration is used as the state for the next iteration
+	 * @return future resolved by the state once the condition returns false. If the body
+	 *  or the condition throws an exception, or the future returned by the body is resolved by an exception,
+	 *  the loop stops and the future is resolved by that exception
+	 *
+	 * The loop runs in constant memory and the stack doesn't grow with iterations. Iterations which
+	 * return already resolved future are executed in a cycle. Pending iterations continue in the
+	 * thread which resolves the future.
+	 *
+	 * @code
+	 * Future<int> total = asyncLoop(0, [](int n) { return n < 100; }, [](int n) {
+	 *     return readChunk(n) >> [n](int size) { return n + size; };
+	 * });
+	 * @endcode
+	 */
+	template<typename T, typename Cond, typename Body>
+	Future<T> asyncLoop(const T &init, const Cond &cond, const Body &body) {
+		Future<T> res;
+		(new _hlp::AsyncLoop<T, Cond, Body>(cond, body, res.getPromise()))->run(init);
+		return res;
+	}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include "dispatcher.h"
+
+namespace yasync {
+
+///Executes functions serially per key
+/** The executor owns a fixed set of strands (see DispatchFn::strand()) on the common underlying
+ * dispatcher. Keys are hashed onto the strands, so functions dispatched under the same key are
+ * executed in order of arrival and never concurrently. Functions of different keys usually run in
+ * parallel, however keys which share a strand are serialized too.
+ *
+ * @code
+ * KeyedExecutor sessions(pool);
+ * sessions[sessionId] >> [=]{...};
+ * @endcode
+ *
+ * The executor can be copied, copies share the strands.
+ */
+class KeyedExecutor {
+public:
+
+	///Creates the executor
+	/**
+	 * @param underlying dispatcher which executes the functions, typically a thread pool
+	 * @param strands count of strands. More strands means less unrelated keys serialized
+	 * together. Strands don't occupy threads, they are cheap
+	 */
+	KeyedExecutor(const DispatchFn &underlying, std::size_t strands = 256) {
+		if (strands == 0) strands = 1;
+		this->strands.reserve(strands);
+		for (std::size_t i = 0; i < strands; i++) {
+			this->strands.push_back(DispatchFn::strand(underlying));
+		}
+	}
+
+	///Retrieves dispatcher of the strand for given key
+	template<typename Key>
+	const DispatchFn &operator[](const Key &key) const {
+		return strands[std::hash<Key>()(key) % strands.size()];
+	}
+
+	///Retrieves count of strands
+	std::size_t size() const {
+		return strands.size();
+	}
+
+protected:
+	std::vector<DispatchFn> strands;
+};
+
+}
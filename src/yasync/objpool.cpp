@@ -0,0 +1,153 @@
+#include <mutex>
+#include <new>
+#include "objpool.h"
+
+namespace yasync {
+
+namespace {
+
+	///Granularity of size classes
+	static const std::size_t granularity = 16;
+	static const std::size_t classCount = ObjPool::maxSize / granularity;
+	///Count of blocks moved between the thread cache and the depot at once
+	static const unsigned int batchSize = 32;
+
+	struct FreeBlock {
+		///next block in the batch
+		FreeBlock *next;
+		///next batch in the depot (valid for the first block of the batch)
+		FreeBlock *nextBatch;
+	};
+
+	class Depot {
+	public:
+		Depot() {
+			for (std::size_t i = 0; i < classCount; i++) batches[i] = nullptr;
+		}
+
+		///Retrieves the batch of free blocks. Allocates new blocks if the depot is empty
+		FreeBlock *getBatch(std::size_t cls) {
+			{
+				std::lock_guard<std::mutex> _(lk);
+				FreeBlock *b = batches[cls];
+				if (b) {
+					batches[cls] = b->nextBatch;
+					return b;
+				}
+			}
+			std::size_t sz = (cls + 1) * granularity;
+			char *slab = reinterpret_cast<char *>(::operator new(sz * batchSize));
+			FreeBlock *lst = nullptr;
+			for (unsigned int i = batchSize; i > 0; i--) {
+				FreeBlock *x = reinterpret_cast<FreeBlock *>(slab + (i - 1) * sz);
+				x->next = lst;
+				lst = x;
+			}
+			return lst;
+		}
+
+		void putBatch(std::size_t cls, FreeBlock *batch) {
+			std::lock_guard<std::mutex> _(lk);
+			batch->nextBatch = batches[cls];
+			batches[cls] = batch;
+		}
+
+		///Depot is never destroyed, threads can release blocks during the exit
+		static Depot &getInstance() {
+			static Depot *d = new Depot;
+			return *d;
+		}
+
+	protected:
+		std::mutex lk;
+		FreeBlock *batches[classCount];
+	};
+
+	class ThreadCache {
+	public:
+		ThreadCache() {
+			for (std::size_t i = 0; i < classCount; i++) {
+				lists[i] = nullptr;
+				counts[i] = 0;
+			}
+		}
+		~ThreadCache();
+
+		void *alloc(std::size_t cls) {
+			FreeBlock *x = lists[cls];
+			if (x == nullptr) {
+				x = Depot::getInstance().getBatch(cls);
+				unsigned int cnt = 0;
+				for (FreeBlock *y = x; y; y = y->next) cnt++;
+				counts[cls] = cnt;
+			}
+			lists[cls] = x->next;
+			counts[cls]--;
+			return x;
+		}
+
+		void free(void *ptr, std::size_t cls) {
+			FreeBlock *x = reinterpret_cast<FreeBlock *>(ptr);
+			x->next = lists[cls];
+			lists[cls] = x;
+			if (++counts[cls] >= 2 * batchSize) {
+				//move the batch to the depot, keep the rest in the cache
+				FreeBlock *last = x;
+				for (unsigned int i = 1; i < batchSize; i++) last = last->next;
+				lists[cls] = last->next;
+				last->next = nullptr;
+				counts[cls] -= batchSize;
+				Depot::getInstance().putBatch(cls, x);
+			}
+		}
+
+	protected:
+		FreeBlock *lists[classCount];
+		unsigned int counts[classCount];
+	};
+
+	///Set after the thread cache is destroyed. Blocks are then exchanged with the depot directly
+	static thread_local bool cacheDestroyed = false;
+	static thread_local ThreadCache cache;
+
+	ThreadCache::~ThreadCache() {
+		cacheDestroyed = true;
+		for (std::size_t i = 0; i < classCount; i++) {
+			if (lists[i]) Depot::getInstance().putBatch(i, lists[i]);
+		}
+	}
+
+	std::size_t sizeClass(std::size_t sz) {
+		return sz ? (sz - 1) / granularity : 0;
+	}
+
+}
+
+void *ObjPool::alloc(std::size_t sz) {
+	if (sz > maxSize) return ::operator new(sz);
+	std::size_t cls = sizeClass(sz);
+	if (cacheDestroyed) {
+		FreeBlock *b = Depot::getInstance().getBatch(cls);
+		if (b->next) Depot::getInstance().putBatch(cls, b->next);
+		return b;
+	}
+	return cache.alloc(cls);
+}
+
+void ObjPool::free(void *ptr, std::size_t sz) throw() {
+	if (ptr == nullptr) return;
+	if (sz > maxSize) {
+		::operator delete(ptr);
+		return;
+	}
+	std::size_t cls = sizeClass(sz);
+	if (cacheDestroyed) {
+		FreeBlock *b = reinterpret_cast<FreeBlock *>(ptr);
+		b->next = nullptr;
+		Depot::getInstance().putBatch(cls, b);
+		return;
+	}
+	cache.free(ptr, cls);
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace yasync {
+
+
+///Allocator of small objects
+/** Memory is organized to size classes. Each thread has own cache of free blocks for each size class,
+ * so allocation and deallocation don't need any synchronization. Blocks released in other thread
+ * are returned to the releasing thread's cache. When the cache becomes too large, a batch of blocks is moved
+ * to the global depot, where other threads can take it. Only the depot is protected by the mutex.
+ *
+ * Blocks are never returned to the system, they are reused for next allocations. Objects larger
+ * than maxSize are allocated by global allocator.
+ */
+class ObjPool {
+public:
+	///Size of the largest object allocated from the pool
+	static const std::size_t maxSize = 256;
+
+	///Allocates the block
+	static void *alloc(std::size_t sz);
+	///Releases the block. Size must be same as the size used for allocation
+	static void free(void *ptr, std::size_t sz) throw();
+};
+
+///Base class for objects allocated from the object pool
+/** Allocation of the objects inherited from this class is routed to the ObjPool. Placement new is
+ * not available, the class hides it.
+ *
+ * Blocks of the pool are aligned to 16 bytes. Over-aligned objects are allocated by the
+ * global aligned allocator (C++17 and later)
+ *
+ * Define YASYNC_DISABLE_OBJPOOL to use the global allocator instead
+ */
+class PoolAlloc {
+public:
+#ifndef YASYNC_DISABLE_OBJPOOL
+	static void *operator new(std::size_t sz) {
+		return ObjPool::alloc(sz);
+	}
+	static void operator delete(void *ptr, std::size_t sz) {
+		ObjPool::free(ptr, sz);
+	}
+#ifdef __cpp_aligned_new
+	static void *operator new(std::size_t sz, std::align_val_t al) {
+		return ::operator new(sz, al);
+	}
+	static void operator delete(void *ptr, std::size_t, std::align_val_t al) {
+		::operator delete(ptr, al);
+	}
+#endif
+#endif
+};
+
+}
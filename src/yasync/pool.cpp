@@ -4,24 +4,42 @@
  *  Created on: 30. 11. 2016
  *      Author: ondra
  */
+#include <algorithm>
+#include <chrono>
 #include <thread>
 #include <deque>
+#include <vector>
 #include "pool.h"
 
 #include "condvar.h"
+#include "gate.h"
 
 #include "semaphore.h"
 #include "fastmutex.h"
 #include "dispatcher.h"
+#include "dispatchqueue.h"
 #include "nulllock.h"
+#include "wspool.h"
+#include "scheduler.h"
 
 using std::deque;
 namespace yasync {
 
 
 	class ThreadPoolImpl;
+	class ThreadQueueState;
 	typedef RefCntPtr<ThreadPoolImpl> PPool;
 
+	///Count of functions taken from the LIFO slot in row before the queue is served
+	static const unsigned int lifoStreakLimit = 3;
+	///Time in microseconds after which other workers take a function left in the LIFO slot
+	static const unsigned int lifoSlotTimeout = 1000;
+	///Count of latency samples evaluated at once by the elastic sizing
+	static const std::size_t latencyWindow = 64;
+
+	///State of the pool's worker which runs in the current thread
+	static thread_local ThreadQueueState *curWorker = nullptr;
+
 	class ThreadPoolImpl: public AbstractDispatcher {
 	public:
 
@@ -30,15 +48,19 @@ namespace yasync {
 		ThreadPoolImpl(const Config &cfg);
 
 		DispatchFn createControl();
+		void startMinThreads();
 
 		bool dispatch(const AbstractDispatcher::Fn &fn) throw();
+		std::size_t dispatchMany(const AbstractDispatcher::Fn *fns, std::size_t count) throw();
+		std::size_t getQueueDepth(Priority priority) throw();
 		void finish();
 
 		~ThreadPoolImpl() {
 			cfg.getFinalStop()();
 		}
 
-		bool yield(unsigned int recursion) throw();
+		bool yield(ThreadQueueState &st) throw();
+		void yieldOrHalt(ThreadQueueState &st) throw();
 
 
 	protected:
@@ -46,9 +68,36 @@ namespace yasync {
 		FastMutex lk;
 		CondVar<NullLock> workerTrigger;
 		CondVar<NullLock> queueTrigger;
-		std::deque<AbstractDispatcher::Fn> queue;
+		///Queued function with time when it was queued
+		struct QueueItem {
+			AbstractDispatcher::Fn fn;
+			Timeout::Clock queued;
+		};
+
+		///queue for each priority level
+		std::deque<QueueItem> lanes[priorityLevels];
+		///count of functions in all lanes
+		std::size_t queueSize;
+		///selects the lane served next
+		_hlp::LaneSelector laneSelector;
+		///functions dispatched by dispatchAsync() waiting for space in the queue
+		std::deque<AbstractDispatcher::Fn> deferred;
+		///List of running workers (their LIFO slots)
+		ThreadQueueState *workers;
 		unsigned int threadCount;
 		bool finishFlag;
+		///counts workers started by start() while it waits for them
+		CountGate *readyGate;
+		///count of workers waiting for a task
+		unsigned int idleWorkers;
+		///count of workers waiting for a future, while they can run a task
+		unsigned int haltedWorkers;
+		///current limit of threads set by the elastic sizing
+		unsigned int softLimit;
+		///queue latencies in microseconds collected by the elastic sizing
+		std::vector<unsigned int> latencies;
+		///the stalled queue is going to be checked by the scheduler
+		bool stallCheck;
 
 		class Control: public AbstractDispatcher {
 		public:
@@ -58,6 +107,12 @@ namespace yasync {
 			virtual bool dispatch(const Fn &fn) throw() {
 				return pool->dispatch(fn);
 			}
+			virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw() {
+				return pool->dispatchMany(fns, count);
+			}
+			virtual std::size_t getQueueDepth(Priority priority) throw() {
+				return pool->getQueueDepth(priority);
+			}
 			virtual ~Control() {
 				pool->finish();
 			}
@@ -74,21 +129,100 @@ namespace yasync {
 
 
 		void startThread();
-		void runWorker() throw();
-		void runWorkerCycle() throw();
+		void wakeWorkers(std::size_t count);
+		void runWorker(ThreadQueueState &st) throw();
+		void runWorkerCycle(ThreadQueueState &st) throw();
+		AbstractDispatcher::Fn pickTask(ThreadQueueState &st);
+		void clearSlots();
+		bool keepAlive() const;
+		bool waitForSpace();
+		void enqueue(AbstractDispatcher::Fn &&fn);
+		QueueItem popFront(unsigned int lane);
+		void clearQueue();
+		unsigned int threadLimit() const;
+		void sampleLatency(const Timeout::Clock &queued);
+		void adjustThreads();
+		void checkStall();
 	bool queueIsFull();
 	bool queueIsEmpty();
 
+};
+
+class ThreadQueueState : public IDispatchQueueControl {
+public:
+	ThreadQueueState(ThreadPoolImpl *poolImpl) :poolImpl(poolImpl), recursionCount(0), streak(0), next(nullptr) {}
+
+
+	virtual bool yield()  throw() {
+		recursionCount++;
+		bool res = poolImpl->yield(*this);
+		recursionCount--;
+		return res;
+	}
+	virtual void yieldOrHalt() throw() {
+		recursionCount++;
+		poolImpl->yieldOrHalt(*this);
+		recursionCount--;
+	}
+	virtual DispatchFn getDispatch() throw() {
+		return RefCntPtr<AbstractDispatcher>(poolImpl);
+	}
+
+	///Resolves future of the function moved to the queue from the deferred queue (outside of the lock)
+	void flushPromoted() {
+		if (promoted != nullptr) {
+			AbstractDispatchedFunction *p = promoted;
+			static_cast<AbstractAsyncDispatchedFunction *>(p)->setQueued();
+			promoted = nullptr;
+		}
+	}
+
+	ThreadPoolImpl *poolImpl;
+	unsigned int recursionCount;
+	///function moved to the queue by this worker, its future must be resolved
+	AbstractDispatcher::Fn promoted;
+	///function which runs next on this worker (protected by the pool's lock)
+	AbstractDispatcher::Fn slot;
+	///time when the function was stored to the slot
+	Timeout::Clock slotTime;
+	///count of functions taken from the slot in row
+	unsigned int streak;
+	///next worker of the pool
+	ThreadQueueState *next;
+
 };
 
 	ThreadPoolImpl::ThreadPoolImpl(const Config& cfg)
 		:cfg(cfg)
 		,workerTrigger(nullLock,true)
 		,queueTrigger(nullLock,false)
-		,threadCount(0),finishFlag(false) {
+		,queueSize(0),workers(nullptr),threadCount(0),finishFlag(false),readyGate(nullptr)
+		,idleWorkers(0),haltedWorkers(0),softLimit(std::max(1U, std::min(cfg.getMinThreads(), cfg.getMaxThreads())))
+		,stallCheck(false) {
+		if (cfg.getTargetQueueLatency()) latencies.reserve(latencyWindow);
 
 	}
 
+	void ThreadPoolImpl::startMinThreads() {
+		unsigned int n = std::min(cfg.getMinThreads(), cfg.getMaxThreads());
+		if (n == 0) return;
+		CountGate ready(n);
+		{
+			LockScope<FastMutex> _(lk);
+			if (cfg.isWaitForMinThreads()) readyGate = &ready;
+			while (threadCount < n) startThread();
+		}
+		if (cfg.isWaitForMinThreads()) {
+			ready.wait();
+			LockScope<FastMutex> _(lk);
+			readyGate = nullptr;
+		}
+	}
+
+	bool ThreadPoolImpl::keepAlive() const {
+		return !finishFlag && threadCount <= cfg.getMinThreads();
+	}
+
 	DispatchFn ThreadPoolImpl::createControl() {
 		void *p = controlSpace;
 		RefCntPtr<AbstractDispatcher> d(new(p) Control(this));
@@ -96,58 +230,253 @@ namespace yasync {
 	}
 
 	bool ThreadPoolImpl::queueIsFull() {
-		return queue.size() >= cfg.getMaxQueue();
+		return queueSize >= cfg.getMaxQueue();
 	}
 
 	bool ThreadPoolImpl::dispatch(const AbstractDispatcher::Fn& fn) throw()  {
+		//dropped function must be released outside of the lock
+		AbstractDispatcher::Fn dropped;
 		LockScope<FastMutex> _(lk);
 		if (fn == ThreadPool::clearQueueCmd) {
-			queue.clear();
+			clearQueue();
+			deferred.clear();
+			clearSlots();
 			return true;
 		}
+		//function dispatched by own worker is stored to its LIFO slot
+		if (cfg.isLifoSlot() && curWorker != nullptr && curWorker->poolImpl == this) {
+			if (curWorker->slot == nullptr) {
+				if (!queueIsFull() && (idleWorkers || haltedWorkers || threadCount < threadLimit())) {
+					//other worker is free, it takes the function now, the owner can block before
+					//it picks the function from the slot
+					enqueue(AbstractDispatcher::Fn(fn));
+					wakeWorkers(1);
+					return true;
+				}
+				curWorker->slot = fn;
+				curWorker->slotTime = std::chrono::steady_clock::now();
+				return true;
+			}
+			if (!queueIsFull()) {
+				//displaced function is moved to the queue
+				enqueue(std::move(curWorker->slot));
+				curWorker->slot = fn;
+				curWorker->slotTime = std::chrono::steady_clock::now();
+				wakeWorkers(1);
+				return true;
+			}
+			//the queue is full, the displaced function would exceed the limit. The function
+			//is handled by the overflow policy
+		}
 
 		//if queue is full
 		if (queueIsFull()) {
-			//calculate timeout
-			Timeout tm ( cfg.getQueueTimeout() == 0?Timeout(nullptr):Timeout(cfg.getIdleTimeout()));
-			//select wait operation
-			bool dow = cfg.isDispatchOnWait();
-			//this will set to true when timeouted
-			bool timeouted = false;
-			//cycle while not timeouted and queue is full
-			while (queueIsFull() && !timeouted) {
-				//acquire queue lock
-				auto t = queueTrigger.ticket();
-				//unlock scope for waiting
-				UnlockScope<FastMutex> _(lk);
-				//depend on wait op
-				if (dow) {
-					//while not timeouted and not signaled
-					while (!t && !timeouted) {
-						//sleep and dispatch, mark if timeouted
-						timeouted = sleepAndDispatch(tm);
-					}
-				}  else {
-					//while not timeouted and not signaled
-					while (!t && !timeouted) {
-						//sleep and dispatch, mark if timeouted
-						timeouted = sleep(tm);
+			//asynchronous dispatch never waits, the function waits aside
+			AbstractDispatchedFunction *p = fn;
+			AbstractAsyncDispatchedFunction *a = dynamic_cast<AbstractAsyncDispatchedFunction *>(p);
+			if (a) {
+				a->defer();
+				deferred.push_back(fn);
+				return true;
+			}
+			switch (cfg.getOverflowPolicy()) {
+			case ThreadPool::reject:
+				return false;
+			case ThreadPool::callerRuns: {
+					UnlockScope<FastMutex> _(lk);
+					fn->execute();
+					return true;
+				}
+			case ThreadPool::dropOldest:
+				//the oldest function of the lowest priority is dropped
+				for (unsigned int l = 0; l < priorityLevels; l++) {
+					if (!lanes[l].empty()) {
+						dropped = std::move(popFront(l).fn);
+						break;
 					}
 				}
-				//we are signaled or timeouted
+				break;
+			default:
+				if (!waitForSpace()) return false;
+				break;
 			}
-			//wait block finished (whathever reason), finnaly check queue
-			if (queueIsFull())
-				//still full, we cannot continue
-				return false;
 		}
 		//push task to the thread
-		queue.push_back(fn);
-		//alert one worker. if none available, the create new one
-		if (!workerTrigger.notifyOne() && threadCount < cfg.getMaxThreads()) {
+		enqueue(AbstractDispatcher::Fn(fn));
+		wakeWorkers(1);
+		return true;
+	}
+
+	void ThreadPoolImpl::enqueue(AbstractDispatcher::Fn &&fn) {
+		QueueItem item;
+		item.fn = std::move(fn);
+		//the time is needed only by the elastic sizing
+		if (cfg.getTargetQueueLatency()) item.queued = std::chrono::steady_clock::now();
+		std::deque<QueueItem> &lane = lanes[item.fn->getPriority()];
+		const Timeout &deadline = item.fn->getDeadline();
+		if (cfg.isEarliestDeadlineFirst() && !deadline.isInfinite()) {
+			//lane is ordered by deadlines, the function is placed after functions with the same deadline
+			auto pos = std::upper_bound(lane.begin(), lane.end(), deadline,
+					[](const Timeout &d, const QueueItem &x) {return d < x.fn->getDeadline();});
+			lane.insert(pos, std::move(item));
+		} else {
+			lane.push_back(std::move(item));
+		}
+		queueSize++;
+	}
+
+	ThreadPoolImpl::QueueItem ThreadPoolImpl::popFront(unsigned int lane) {
+		QueueItem item = std::move(lanes[lane].front());
+		lanes[lane].pop_front();
+		queueSize--;
+		return item;
+	}
+
+	void ThreadPoolImpl::clearQueue() {
+		for (auto &lane : lanes) lane.clear();
+		queueSize = 0;
+	}
+
+	std::size_t ThreadPoolImpl::getQueueDepth(Priority priority) throw() {
+		LockScope<FastMutex> _(lk);
+		return lanes[priority].size();
+	}
+
+	unsigned int ThreadPoolImpl::threadLimit() const {
+		return cfg.getTargetQueueLatency()?softLimit:cfg.getMaxThreads();
+	}
+
+	void ThreadPoolImpl::sampleLatency(const Timeout::Clock &queued) {
+		auto lat = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - queued);
+		latencies.push_back(static_cast<unsigned int>(lat.count()));
+		if (latencies.size() >= latencyWindow) adjustThreads();
+	}
+
+	void ThreadPoolImpl::adjustThreads() {
+		std::size_t k = (latencies.size() - 1) * std::min(cfg.getQueueLatencyPercentile(), 100U) / 100;
+		std::nth_element(latencies.begin(), latencies.begin() + k, latencies.end());
+		unsigned int lat = latencies[k];
+		latencies.clear();
+		unsigned int target = cfg.getTargetQueueLatency();
+		if (lat > target) {
+			//tasks wait too long, allow one more thread
+			if (softLimit < cfg.getMaxThreads()) {
+				softLimit++;
+				if (queueSize && threadCount < softLimit) startThread();
+			}
+		} else if (lat < target / 2 && idleWorkers > 0) {
+			//tasks don't wait and some workers are idle, remove one thread
+			//latencies between the half and the target don't change anything (hysteresis)
+			if (softLimit > std::max(1U, cfg.getMinThreads())) {
+				softLimit--;
+				//idle worker above the limit exits
+				if (threadCount > softLimit) workerTrigger.notifyOne();
+			}
+		}
+	}
+
+	//grows the pool when no worker takes functions from the queue (called under the lock)
+	void ThreadPoolImpl::checkStall() {
+		//samples from the pickTask() don't come when all workers are blocked
+		if (queueSize == 0 || idleWorkers || finishFlag || threadCount < softLimit
+				|| softLimit >= cfg.getMaxThreads()) return;
+		Timeout::Clock now = std::chrono::steady_clock::now();
+		Timeout::Clock oldest = now;
+		for (auto &lane : lanes) {
+			if (!lane.empty()) oldest = std::min(oldest, lane.front().queued);
+		}
+		std::chrono::microseconds target(cfg.getTargetQueueLatency());
+		if (now - oldest >= target) {
+			//the oldest function waits too long, allow one more thread
+			softLimit++;
+			latencies.clear();
+			if (threadCount < softLimit) startThread();
+			//next thread is allowed after next period
+			oldest = now;
+		}
+		if (!stallCheck) {
+			//check again when the oldest function reaches the target
+			stallCheck = true;
+			PPool me = this;
+			at(Timeout(oldest + target)) >> [me] {
+				LockScope<FastMutex> _(me->lk);
+				me->stallCheck = false;
+				me->checkStall();
+			};
+		}
+	}
+
+	//blocks the caller until there is space in the queue (called under the lock)
+	bool ThreadPoolImpl::waitForSpace() {
+		//calculate timeout
+		Timeout tm ( cfg.getQueueTimeout() == 0?Timeout(nullptr):Timeout(cfg.getQueueTimeout()));
+		//select wait operation
+		bool dow = cfg.isDispatchOnWait();
+		//this will set to true when timeouted
+		bool timeouted = false;
+		//cycle while not timeouted and queue is full
+		while (queueIsFull() && !timeouted) {
+			//acquire queue lock
+			auto t = queueTrigger.ticket();
+			//unlock scope for waiting
+			UnlockScope<FastMutex> _(lk);
+			//depend on wait op
+			if (dow) {
+				//while not timeouted and not signaled
+				while (!t && !timeouted) {
+					//sleep and dispatch, mark if timeouted
+					timeouted = sleepAndDispatch(tm);
+				}
+			}  else {
+				//while not timeouted and not signaled
+				while (!t && !timeouted) {
+					//sleep and dispatch, mark if timeouted
+					timeouted = sleep(tm);
+				}
+			}
+			//we are signaled or timeouted
+		}
+		//wait block finished (whathever reason), finnaly check queue
+		//still full, we cannot continue
+		return !queueIsFull();
+	}
+
+	std::size_t ThreadPoolImpl::dispatchMany(const AbstractDispatcher::Fn *fns, std::size_t count) throw() {
+		std::size_t processed = 0;
+		{
+			LockScope<FastMutex> _(lk);
+			std::size_t added = 0;
+			//push as many tasks as the queue can hold
+			while (processed < count && !queueIsFull()) {
+				const AbstractDispatcher::Fn &fn = fns[processed];
+				if (fn == ThreadPool::clearQueueCmd) {
+					clearQueue();
+					deferred.clear();
+					clearSlots();
+					added = 0;
+				} else {
+					enqueue(AbstractDispatcher::Fn(fn));
+					added++;
+				}
+				processed++;
+			}
+			wakeWorkers(added);
+		}
+		//queue is full, rest of tasks are dispatched one by one - this can wait for free space
+		while (processed < count && dispatch(fns[processed])) processed++;
+		return processed;
+	}
+
+	void ThreadPoolImpl::wakeWorkers(std::size_t count) {
+		//alert idle workers, no more than count
+		while (count && workerTrigger.notifyOne()) count--;
+		//no more idle workers, create new ones for the rest
+		while (count && threadCount < threadLimit()) {
 			startThread();
+			count--;
 		}
-		return true;
+		//functions which no worker takes drive the elastic sizing
+		if (count && cfg.getTargetQueueLatency()) checkStall();
 	}
 
 	void ThreadPoolImpl::finish() {
@@ -160,52 +489,103 @@ namespace yasync {
 	}
 
 	bool ThreadPoolImpl::queueIsEmpty() {
-		return queue.empty() && !finishFlag;
+		return queueSize == 0 && !finishFlag;
 	}
 
-	bool ThreadPoolImpl::yield(unsigned int recursion) throw()
+
+	bool ThreadPoolImpl::yield(ThreadQueueState &st) throw()
 	{
-		if (recursion > cfg.getMaxYieldRecursion()) 
-			return false;
-		if (queue.empty()) {
+		if (st.recursionCount > cfg.getMaxYieldRecursion())
 			return false;
-		}
 		LockScope<FastMutex> _(lk);
-		if (!queue.empty()) {
-			AbstractDispatcher::Fn fn = queue.front();
-			queue.pop_front();
-			//alert any waiting thread for empty queue
-			queueTrigger.notifyOne();
+		AbstractDispatcher::Fn fn = pickTask(st);
+		if (fn != nullptr) {
 			//unlock pool - task will not interact with it
 			UnlockScope<FastMutex> _(lk);
+			st.flushPromoted();
 			//run task
-			fn->run();
+			fn->execute();
+			//release the task before the pool is locked again, it can hold the last reference to the pool
+			fn = nullptr;
 			return true;
 		}
 		return false;
 
 	}
 
-
-class ThreadQueueState : public IDispatchQueueControl {
-public:
-	ThreadQueueState(ThreadPoolImpl *poolImpl) :poolImpl(poolImpl), recursionCount(0){}
-
-
-	virtual bool yield()  throw() {
-		recursionCount++;
-		bool res = poolImpl->yield(recursionCount);
-		recursionCount--;
-		return res;
-	}
-	virtual DispatchFn getDispatch() throw() {
-		return RefCntPtr<AbstractDispatcher>(poolImpl);
+	void ThreadPoolImpl::yieldOrHalt(ThreadQueueState &st) throw() {
+		if (st.recursionCount > cfg.getMaxYieldRecursion()) {
+			halt();
+			return;
+		}
+		AbstractDispatcher::Fn fn;
+		{
+			LockScope<FastMutex> _(lk);
+			fn = pickTask(st);
+			if (fn == nullptr) {
+				//wait as an idle worker, so a new task wakes this thread
+				auto t = workerTrigger.ticket();
+				haltedWorkers++;
+				{
+					UnlockScope<FastMutex> _(lk);
+					halt();
+				}
+				haltedWorkers--;
+				//alerted by other reason
+				if (!t) return;
+				//notified worker must take the task, otherwise the notification is lost
+				fn = pickTask(st);
+				if (fn == nullptr) return;
+			}
+		}
+		st.flushPromoted();
+		fn->execute();
 	}
 
-	ThreadPoolImpl *poolImpl;
-	unsigned int recursionCount;
+	AbstractDispatcher::Fn ThreadPoolImpl::pickTask(ThreadQueueState &st) {
+		AbstractDispatcher::Fn fn;
+		if (st.slot != nullptr) {
+			if (st.streak < lifoStreakLimit) {
+				st.streak++;
+				return std::move(st.slot);
+			}
+			//too many functions from the slot in row, give chance to the queue
+			enqueue(std::move(st.slot));
+		}
+		st.streak = 0;
+		if (cfg.isLifoSlot()) {
+			//function left in the slot of a blocked worker is taken before the queue
+			Timeout::Clock expired = std::chrono::steady_clock::now() - std::chrono::microseconds(lifoSlotTimeout);
+			for (ThreadQueueState *w = workers; w; w = w->next) {
+				if (w->slot != nullptr && w->slotTime < expired) return std::move(w->slot);
+			}
+		}
+		int lane = laneSelector.select([this](int i) {return lanes[i].empty();});
+		if (lane >= 0) {
+			QueueItem item = popFront(lane);
+			fn = std::move(item.fn);
+			if (cfg.getTargetQueueLatency()) sampleLatency(item.queued);
+			if (!deferred.empty()) {
+				//space in the queue is given to the deferred function first
+				st.promoted = deferred.front();
+				enqueue(std::move(deferred.front()));
+				deferred.pop_front();
+			} else {
+				//alert any waiting thread for empty queue
+				queueTrigger.notifyOne();
+			}
+			return fn;
+		}
+		//queue is empty, steal function from slot of other worker
+		for (ThreadQueueState *w = workers; w; w = w->next) {
+			if (w->slot != nullptr) return std::move(w->slot);
+		}
+		return fn;
+	}
 
-};
+	void ThreadPoolImpl::clearSlots() {
+		for (ThreadQueueState *w = workers; w; w = w->next) w->slot = nullptr;
+	}
 
 
 void ThreadPoolImpl::startThread() {
@@ -214,55 +594,77 @@ void ThreadPoolImpl::startThread() {
 	::yasync::newThread >> [me] {
 		ThreadQueueState st(me);
 		ThreadQueueState::setThreadQueueControl(&st);
-		me->runWorker();
+		curWorker = &st;
+		me->runWorker(st);
+		curWorker = nullptr;
 	};
 }
 
 
-void ThreadPoolImpl::runWorker() throw() {
+void ThreadPoolImpl::runWorker(ThreadQueueState &st) throw() {
 
 
+	//idle worker spins a while before it is parked
+	setThreadSpinTime(cfg.getSpinTime());
 	cfg.getThreadStart()();
 
 	//run worker's cycle
-	runWorkerCycle();
+	runWorkerCycle(st);
 
 	cfg.getThreadStop()();
+	setThreadSpinTime(0);
 }
 
-void ThreadPoolImpl::runWorkerCycle() throw() {
+void ThreadPoolImpl::runWorkerCycle(ThreadQueueState &st) throw() {
+	{
+		//register the worker
+		LockScope<FastMutex> _(lk);
+		st.next = workers;
+		workers = &st;
+		if (readyGate) (*readyGate)();
+	}
 	do {
 		//lock the pool - we will interact with it
 		LockScope<FastMutex> _(lk);
-		//check queue, is empty?
-		if (queueIsEmpty()) {
+		//pick task from the slot or from the queue
+		AbstractDispatcher::Fn fn = pickTask(st);
+		if (fn == nullptr && (threadCount <= threadLimit() || keepAlive())) {
 			//queue is empty, we must wait now - define how long
-			Timeout tm(cfg.getIdleTimeout());
-			//cycle while queue is empty and not timeout
-			while (queueIsEmpty()) {
+			//(workers up to minThreads are never retired)
+			Timeout tm(keepAlive()?Timeout(nullptr):Timeout(cfg.getIdleTimeout()));
+			idleWorkers++;
+			//cycle while queue is empty and not timeout (or the worker is above the limit)
+			while (queueIsEmpty() && threadCount <= threadLimit()) {
 				//unlock scope and wait for trigger
 				if (!workerTrigger.unlockAndWait(tm,lk)) break;
 			}
+			idleWorkers--;
+			//this part can be reached if
+			// - queue is not empty
+			// - finishFlag is true
+			// - waiting has timeouted
+			// check queue - has tasks? - finishFlag applied after all task are processed
+			fn = pickTask(st);
 		}
-		//this part can be reached if
-		// - queue is not empty
-		// - finishFlag is true
-		// - waiting has timeouted
-		// check queue - has tasks? - finishFlag applied after all task are processed
-		if (!queue.empty()) {
-			//pick task from queue
-			AbstractDispatcher::Fn fn = queue.front();
-			queue.pop_front();
-			//alert any waiting thread for empty queue
-			queueTrigger.notifyOne();
+		if (fn != nullptr) {
 			//unlock pool - task will not interact with it
 			UnlockScope<FastMutex> _(lk);
+			st.flushPromoted();
 			//run task
-			fn->run();
+			fn->execute();
+			//release the task before the pool is locked again, it can hold the last reference to the pool
+			fn = nullptr;
+		} else if (keepAlive()) {
+			//timeout, but the pool needs this worker
+			continue;
 		} else {
 			//finishFlag is true or timeout
 			//decrease count of threads
 			--threadCount;
+			//unregister the worker
+			ThreadQueueState **p = &workers;
+			while (*p != &st) p = &(*p)->next;
+			*p = st.next;
 			//exit cycle
 			return;
 		}
@@ -279,6 +681,15 @@ ThreadPool::ThreadPool()
 	,queueTimeout(0)
 	,maxYieldRecursion(4)
 	,dispatchOnWait(false)
+	,overflowPolicy(block)
+	,workStealing(false)
+	,lifoSlot(false)
+	,spinTime(0)
+	,minThreads(0)
+	,waitForMinThreads(false)
+	,targetQueueLatency(0)
+	,queueLatencyPercentile(90)
+	,earliestDeadlineFirst(false)
 	,threadStart(nullptr)
 	,threadStop(nullptr)
 	,finalStop(nullptr)
@@ -286,8 +697,11 @@ ThreadPool::ThreadPool()
 }
 
 DispatchFn ThreadPool::start() {
+	if (workStealing) return startWorkStealingPool(*this);
 	PPool pool = new ThreadPoolImpl(*this);
-	return pool->createControl();
+	DispatchFn d = pool->createControl();
+	pool->startMinThreads();
+	return d;
 }
 
 RefCntPtr<AbstractDispatchedFunction> ThreadPool::clearQueueCmd(nullptr);
@@ -7,9 +7,11 @@
 
 #pragma once
 #include <algorithm>
+#include <atomic>
 
 #include "alertfn.h"
 #include "dispatcher.h"
+#include "future.h"
 
 
 namespace yasync {
@@ -22,10 +24,27 @@ namespace yasync {
  * To create running pool, call ThreadPool::start(). The function returns DispatchFn, which is used to
  * post tasks to the running pool. The pool is destroyed with the last reference to it. The pool stops its threads at
  * background, so destroying the last reference will not involve blocking call.
+ *
+ * The queue of the pool has a lane for each priority level (see DispatchFn::withPriority()). Workers
+ * take functions from the highest non-empty lane, lower lanes are aged, so they cannot starve. The
+ * limit maxQueue applies to all lanes together. The depth of each lane is available through
+ * DispatchFn::getQueueDepth().
  */
 class ThreadPool {
 public:
 
+	///Defines what happens when a function is dispatched to the full queue
+	enum OverflowPolicy {
+		///Caller is blocked until there is space in the queue or until the queue timeout expires (default)
+		block,
+		///Function is rejected immediately, dispatching returns false
+		reject,
+		///Function is executed by the caller
+		callerRuns,
+		///The oldest function of the lowest priority in the queue is dropped to make a space. Its future (if any) is canceled
+		dropOldest
+	};
+
 	///setup the thread pool to initial settings
 	/**
 	 * maxThreads = available CPUs
@@ -163,6 +182,23 @@ public:
 		return *this;
 	}
 
+	OverflowPolicy getOverflowPolicy() const {
+		return overflowPolicy;
+	}
+
+	///Sets overflow policy
+	/**
+	 * @param overflowPolicy defines what happens when a function is dispatched to the full
+	 * queue. Default is ThreadPool::block. Options dispatchOnWait and queueTimeout apply to
+	 * the block policy only. Functions dispatched through dispatchAsync() are never blocked nor
+	 * rejected because of the full queue, they wait for space in the pool. The policy applies to the injection
+	 * queue in work-stealing mode.
+	 */
+	ThreadPool &setOverflowPolicy(OverflowPolicy overflowPolicy) {
+		this->overflowPolicy = overflowPolicy;
+		return *this;
+	}
+
 	unsigned int getQueueTimeout() const {
 		return queueTimeout;
 	}
@@ -208,11 +244,187 @@ public:
 		return maxYieldRecursion;
 	}
 
+	///Sets maximum recursion of yield()
+	/**
+	 * @param v count of nested functions which a thread of the pool can process through yield()
+	 * or while it is waiting for a future (see yieldOrHalt()). Once the limit is reached, the
+	 * waiting thread just halts. Default is 4. The option applies to work-stealing mode as well.
+	 */
 	ThreadPool& setMaxYieldRecursion(unsigned int v) {
 		maxYieldRecursion = v;
 		return *this;
 	}
 
+	bool isWorkStealing() const {
+		return workStealing;
+	}
+
+	///Enables work-stealing mode
+	/**
+	 * @param workStealing set true to start the pool in work-stealing mode. Default is false, the
+	 * pool has single FIFO queue.
+	 *
+	 * In work-stealing mode, every worker has own deque. Functions dispatched by the pool's
+	 * worker (for example through DispatchFn::thisThread()) are pushed to the worker's deque
+	 * without locking and the worker processes them in LIFO order. Other functions are pushed to
+	 * the shared injection queue. Idle workers take functions from the injection queue
+	 * and steal functions from deques of other workers. The mode scales much better when tasks
+	 * spawn other tasks, however there is no global order of processing.
+	 *
+	 * The limit maxQueue applies to the injection queue only. Workers never block on full queue.
+	 * The clearQueueCmd clears the injection queue only. Priorities of functions are ignored, the
+	 * injection queue is reported as the normal lane.
+	 */
+	ThreadPool& setWorkStealing(bool workStealing) {
+		this->workStealing = workStealing;
+		return *this;
+	}
+
+	bool isLifoSlot() const {
+		return lifoSlot;
+	}
+
+	///Enables LIFO slot of the workers
+	/**
+	 * @param lifoSlot set true to enable the slot. Default is false.
+	 *
+	 * When the slot is enabled, the function dispatched by the pool's worker (for example
+	 * a continuation dispatched through DispatchFn::thisThread()) is not put to the queue. It is
+	 * stored to the worker's slot and it runs on the same worker right after the current function
+	 * finishes, while its data are still in the cache. Only one function fits to the slot, the function
+	 * dispatched earlier is moved to the end of the queue. When the slot is occupied and the queue is full,
+	 * the function is handled by the overflow policy as any other function. To avoid starvation
+	 * of the queue, the worker takes at most 3 functions from the slot in row, then the function
+	 * from the slot is moved to the end of the queue.
+	 *
+	 * The slot is used only while all workers are busy. If there is an idle worker or the pool
+	 * can start a new thread, the function is queued and the idle worker runs it immediately, so
+	 * it is not stuck when the dispatching function blocks. An idle worker which finds the queue empty
+	 * takes the function from a slot of other worker, and any worker takes it before the queue
+	 * when the function stays in the slot longer than 1 millisecond.
+	 *
+	 * The option has no effect in work-stealing mode, where the worker processes own deque in LIFO
+	 * order already.
+	 */
+	ThreadPool& setLifoSlot(bool lifoSlot) {
+		this->lifoSlot = lifoSlot;
+		return *this;
+	}
+
+	unsigned int getSpinTime() const {
+		return spinTime;
+	}
+
+	///Sets how long an idle worker spins before it is parked
+	/**
+	 * @param spinTime spin time in microseconds. Default is 0, the idle worker is parked immediately.
+	 *
+	 * Parking and waking the worker costs a system call and a context switch. When tasks come
+	 * often, it is cheaper to spin a while. The spinning worker stays registered as idle, so
+	 * a new task is handed to it and no new thread is started. The spinning is adaptive, it
+	 * becomes shorter when tasks don't come during spinning (see setThreadSpinTime()). The spin time
+	 * also applies when the task running in the worker waits through sleep() or halt(), including
+	 * dispatching waits as haltAndDispatch(). The option applies to work-stealing mode as well.
+	 */
+	ThreadPool& setSpinTime(unsigned int spinTime) {
+		this->spinTime = spinTime;
+		return *this;
+	}
+
+	unsigned int getMinThreads() const {
+		return minThreads;
+	}
+
+	///Sets count of threads which are always running
+	/**
+	 * @param minThreads count of threads started by start(). These threads are never stopped
+	 * because of idle timeout, so the pool doesn't need to create a thread when tasks come after
+	 * a quiet period. Default is 0, threads are started when tasks come. The value is
+	 * limited by maxThreads. The threads are stopped when the pool finishes. The option applies
+	 * to work-stealing mode as well.
+	 */
+	ThreadPool& setMinThreads(unsigned int minThreads) {
+		this->minThreads = minThreads;
+		return *this;
+	}
+
+	bool isWaitForMinThreads() const {
+		return waitForMinThreads;
+	}
+
+	///Causes that start() waits until the minThreads threads are running
+	/**
+	 * @param waitForMinThreads set true to block start() until all threads specified by
+	 * setMinThreads() are started and ready to take tasks. Default is false, start() returns
+	 * immediately and threads are starting at background.
+	 */
+	ThreadPool& setWaitForMinThreads(bool waitForMinThreads) {
+		this->waitForMinThreads = waitForMinThreads;
+		return *this;
+	}
+
+	unsigned int getTargetQueueLatency() const {
+		return targetQueueLatency;
+	}
+
+	///Enables elastic sizing of the pool driven by the queue latency
+	/**
+	 * @param targetQueueLatency target time in microseconds which a function spends in the
+	 * queue before a worker starts to execute it. Default is 0, which disables the elastic sizing.
+	 *
+	 * When enabled, the pool measures the queue latency of every function and evaluates the
+	 * measurements in windows of 64 samples. When the percentile of the window (see
+	 * setQueueLatencyPercentile()) is above the target, the pool allows one more thread (up
+	 * to maxThreads). When it is below the half of the target and some worker is idle, the pool
+	 * retires one thread (down to minThreads, at least one thread). Latencies between the half
+	 * and the target don't change the count of threads, which prevents thrashing. When
+	 * functions wait in the queue while no worker is idle (for example, all workers are blocked),
+	 * the pool allows one more thread every time the oldest queued function exceeds the target.
+	 *
+	 * Without the elastic sizing, the pool starts a new thread whenever no worker is idle,
+	 * until maxThreads is reached.
+	 *
+	 * @note The option doesn't apply to work-stealing mode, which ignores it.
+	 */
+	ThreadPool& setTargetQueueLatency(unsigned int targetQueueLatency) {
+		this->targetQueueLatency = targetQueueLatency;
+		return *this;
+	}
+
+	unsigned int getQueueLatencyPercentile() const {
+		return queueLatencyPercentile;
+	}
+
+	///Sets percentile of the queue latency compared with the target latency
+	/**
+	 * @param queueLatencyPercentile percentile (0-100). Default is 90
+	 * @see setTargetQueueLatency
+	 */
+	ThreadPool& setQueueLatencyPercentile(unsigned int queueLatencyPercentile) {
+		this->queueLatencyPercentile = queueLatencyPercentile;
+		return *this;
+	}
+
+	bool isEarliestDeadlineFirst() const {
+		return earliestDeadlineFirst;
+	}
+
+	///Orders functions in the queue by their deadlines
+	/**
+	 * @param earliestDeadlineFirst set true to order functions in each lane of the queue by
+	 * their deadlines (see DispatchFn::withDeadline()). Functions without deadline are queued after them
+	 * in order of arrival. Default is false, functions are queued in order of arrival.
+	 *
+	 * Functions which missed their deadline are dropped regardless on this option.
+	 *
+	 * @note The option doesn't apply to work-stealing mode, which ignores it. Late functions
+	 * are dropped in work-stealing mode as well.
+	 */
+	ThreadPool& setEarliestDeadlineFirst(bool earliestDeadlineFirst) {
+		this->earliestDeadlineFirst = earliestDeadlineFirst;
+		return *this;
+	}
+
 
 	private:
 		unsigned int maxThreads;
@@ -221,6 +433,15 @@ public:
 		unsigned int queueTimeout;
 		unsigned int maxYieldRecursion;
 		bool dispatchOnWait;
+		OverflowPolicy overflowPolicy;
+		bool workStealing;
+		bool lifoSlot;
+		unsigned int spinTime;
+		unsigned int minThreads;
+		bool waitForMinThreads;
+		unsigned int targetQueueLatency;
+		unsigned int queueLatencyPercentile;
+		bool earliestDeadlineFirst;
 		AlertFn threadStart;
 		AlertFn threadStop;
 		AlertFn finalStop;
@@ -228,7 +449,86 @@ public:
 	};
 
 
+///Function dispatched by dispatchAsync()
+/** The thread pool, which cannot accept the function because its queue is full, calls defer() and keeps the
+ * function aside. Once there is space in the queue, the function is moved to the queue and the pool
+ * calls setQueued(). Other dispatchers don't need to know about this class.
+ *
+ * The state can be changed by the caller and by the thread which passes the function to the pool (when
+ * the target routes the function), so the future is resolved exactly once.
+ */
+class AbstractAsyncDispatchedFunction: public AbstractDispatchedFunction {
+public:
+	AbstractAsyncDispatchedFunction(const Promise<Void> &queued):queued(queued),state(pending) {}
 
+	///Marks the function as deferred, it is accepted but not queued yet
+	void defer() {
+		unsigned int st = pending;
+		state.compare_exchange_strong(st, deferred, std::memory_order_acq_rel);
+	}
+	///Determines whether the function has been deferred
+	bool isDeferred() const {return state.load(std::memory_order_acquire) == deferred;}
+	///Resolves the future of the dispatchAsync(), unless the function has been deferred
+	void setAccepted() {
+		unsigned int st = pending;
+		if (state.compare_exchange_strong(st, resolved, std::memory_order_acq_rel)) queued.setValue(Void());
+	}
+	///Resolves the future of the dispatchAsync()
+	void setQueued() {
+		if (state.exchange(resolved, std::memory_order_acq_rel) != resolved) queued.setValue(Void());
+	}
+
+protected:
+	enum State {
+		pending,
+		deferred,
+		resolved
+	};
+
+	Promise<Void> queued;
+	std::atomic<unsigned int> state;
+};
+
+namespace _hlp {
+
+	template<typename Fn>
+	class AsyncDispatchedFunction: public AbstractAsyncDispatchedFunction {
+	public:
+		template<typename X>
+		AsyncDispatchedFunction(const Promise<Void> &queued, X &&fn)
+			:AbstractAsyncDispatchedFunction(queued),fn(std::forward<X>(fn)) {}
+		virtual void run() throw() {
+			fn();
+		}
+	protected:
+		Fn fn;
+	};
+}
+
+///Dispatches a function without blocking the caller
+/**
+ * @param target target dispatcher, typically the thread pool
+ * @param fn function to dispatch
+ * @return future which is resolved once the function is in the queue. If the queue of the
+ * thread pool is full, the function waits aside and the future is resolved when the function
+ * is moved to the queue. The caller is never blocked and it can use the future to slow down
+ * (for example, it can postpone next dispatching until the future is resolved). The future is
+ * canceled when the function is rejected, for example when the target thread exited. When the target
+ * routes the function to the pool through other dispatcher, the future can be resolved once the
+ * first dispatcher accepts the function.
+ *
+ * Functions waiting aside are not subject of the queue timeout nor overflow policy, they are removed by the
+ * clearQueueCmd only.
+ */
+template<typename Fn>
+Future<Void> dispatchAsync(const DispatchFn &target, Fn &&fn) {
+	typedef _hlp::AsyncDispatchedFunction<typename std::decay<Fn>::type> F;
+	Future<Void> f;
+	RefCntPtr<AbstractAsyncDispatchedFunction> a(new F(f.getPromise(), std::forward<Fn>(fn)));
+	AbstractDispatchedFunction *p = a;
+	if (target >> AbstractDispatcher::Fn(p)) a->setAccepted();
+	return f;
+}
 
 
 	
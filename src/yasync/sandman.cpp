@@ -5,6 +5,7 @@
  *      Author: ondra
  */
 #include "sandman.h"
+#include "threadcache.h"
 
 namespace yasync {
 
@@ -18,7 +19,17 @@ void SandMan::wakeUp(const std::uintptr_t* reason) throw () {
 	condVar.notify_all();
 }
 
+void SandMan::spin(const Timeout &tm) {
+	auto ready = [this] {
+		return alerted.load(std::memory_order_acquire);
+	};
+	if (tm.isInfinite()) spinner.wait(ready);
+	else spinner.wait(ready, tm);
+}
+
 bool SandMan::sleep(const Timeout& tm, std::uintptr_t* reason) {
+	//spinning never exceeds the timeout, expired timeout doesn't spin
+	spin(tm);
 	std::unique_lock<std::mutex> um(mutx);
 	while (!alerted.load(std::memory_order_acquire)) {
 		if (tm == nullptr) condVar.wait(um);
@@ -40,6 +51,7 @@ bool SandMan::sleep(const Timeout& tm, std::uintptr_t* reason) {
 
 std::uintptr_t SandMan::halt()
 {
+	spin();
 	std::unique_lock<std::mutex> um(mutx);
 	while (!alerted.load(std::memory_order_acquire)) {
 		condVar.wait(um);
@@ -70,15 +82,18 @@ std::uintptr_t halt()
 	return getCurrentSandman()->halt();
 }
 
+void setThreadSpinTime(unsigned int us) {
+	getCurrentSandman()->setSpinTime(us);
+}
+
 AlertFn AlertFn::thisThread() {
 	RefCntPtr<AbstractAlertFunction> x = RefCntPtr<AbstractAlertFunction>::staticCast(getCurrentSandman());
 	return AlertFn(x);
 }
 
 std::uintptr_t initThreadId() {
-	int dummy;
-	int *ptr = &dummy;
-	return (std::uintptr_t)ptr;
+	static std::atomic<std::uintptr_t> nextId(1);
+	return nextId++;
 }
 
 static thread_local std::uintptr_t curThreadId = 0;
@@ -91,4 +106,9 @@ std::uintptr_t thisThreadId() {
 	return x;
 }
 
+void _hlp::resetThreadAlerts() {
+	curSandman = nullptr;
+	curThreadId = 0;
+}
+
 }
@@ -4,6 +4,7 @@
 #include "timeout.h"
 
 #include "alertfn.h"
+#include "spinwait.h"
 namespace yasync {
 
 	class SandMan: public AbstractAlertFunction {
@@ -14,12 +15,17 @@ namespace yasync {
 		virtual void wakeUp(const std::uintptr_t *reason = nullptr) throw();
 		virtual bool sleep(const Timeout &tm, std::uintptr_t *reason = nullptr) ;
 		virtual std::uintptr_t halt();
+		void setSpinTime(unsigned int us) {spinner.setSpinTime(us);}
 
 	protected:
 		std::mutex mutx;
 		std::condition_variable condVar;
 		std::uintptr_t reason;
 		std::atomic_bool alerted;
+		SpinWait spinner;
+
+		///Spins before the thread is parked, no longer than the timeout
+		void spin(const Timeout &tm = Timeout(nullptr));
 
 	};
 
@@ -89,6 +89,29 @@ bool Scheduler::ScheduledFn::dispatch(const Fn& fn) throw ()
 	}
 }
 
+namespace {
+
+	///Runs batch of functions as single function
+	class BatchFn: public AbstractDispatchedFunction {
+	public:
+		BatchFn(const AbstractDispatcher::Fn *fns, std::size_t count):fns(fns, fns+count) {}
+		virtual void run() throw() {
+			for (auto &&f : fns) {
+				if (f != nullptr) f->execute();
+			}
+		}
+	protected:
+		std::vector<AbstractDispatcher::Fn> fns;
+	};
+
+}
+
+std::size_t Scheduler::ScheduledFn::dispatchMany(const Fn *fns, std::size_t count) throw ()
+{
+	//scheduled dispatcher holds one function, so whole batch is combined into single function
+	return dispatch(new BatchFn(fns, count))?count:0;
+}
+
 void Scheduler::ScheduledFn::runScheduled() throw() {
 
 	Fn f;
@@ -97,7 +120,7 @@ void Scheduler::ScheduledFn::runScheduled() throw() {
 		state = fired;
 		f = this->fn;
 	};
-	f->run();
+	f->execute();
 }
 
 
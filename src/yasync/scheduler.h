@@ -48,7 +48,7 @@ public:
 
 protected:
 
-	class ScheduledFn: public AbstractDispatcher {
+	class ScheduledFn: public AbstractDispatcher, public PoolAlloc {
 	public:
 
 		enum State {
@@ -59,6 +59,7 @@ protected:
 
 		ScheduledFn(const Timeout &tm, Scheduler *owner):state(initializing),owner(owner),tm(tm) {}
 		virtual bool dispatch(const Fn &fn) throw();
+		virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw();
 		void runScheduled() throw();
 		const Timeout &getTime() const {return tm;}
 
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace yasync {
+
+///Hints the CPU that the thread is spinning
+/** It lowers power consumption and releases resources to the sibling hyper-thread */
+inline void cpuRelax() {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	_mm_pause();
+#elif defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+	__yield();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	asm volatile("yield");
+#else
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+
+///Adaptive spinning before the thread is parked
+/** Parking the thread and waking it up costs a system call and a context switch. If the event
+ * comes soon, it is cheaper to spin a while. The spinning is bounded by the spin time. The object
+ * observes hits (event came during spinning) and misses. Every miss halves the time of the next
+ * spinning (down to 1/16 of the spin time), every hit doubles it (up to the spin time).
+ *
+ * @note The object is not MT safe, it is used by a single thread
+ */
+class SpinWait {
+public:
+
+	SpinWait():maxSpin(0),curSpin(0) {}
+
+	///Sets spin time in microseconds. Zero disables spinning
+	/** Spinning is always disabled on a single CPU, where the awaited event cannot
+	 * come while this thread is spinning */
+	void setSpinTime(unsigned int us) {
+		static const bool singleCpu = std::thread::hardware_concurrency() == 1;
+		maxSpin = curSpin = singleCpu?0:us;
+	}
+
+	///Retrieves effective spin time in microseconds
+	unsigned int getSpinTime() const {
+		return maxSpin;
+	}
+
+	///Spins until the condition is met or the time is up
+	/**
+	 * @param ready function returns true when the condition is met
+	 * @retval true condition is met
+	 * @retval false time is up (or spinning is disabled)
+	 */
+	template<typename Fn>
+	bool wait(const Fn &ready) {
+		return wait(ready, std::chrono::steady_clock::time_point::max());
+	}
+
+	///Spins until the condition is met, the time is up or the deadline is reached
+	/**
+	 * @param ready function returns true when the condition is met
+	 * @param deadline the spinning never exceeds this time. Nothing is spun if less than
+	 * a microsecond remains. Reaching the deadline doesn't count as a miss
+	 * @retval true condition is met
+	 * @retval false time is up (or spinning is disabled)
+	 */
+	template<typename Fn>
+	bool wait(const Fn &ready, const std::chrono::steady_clock::time_point &deadline) {
+		if (maxSpin == 0) return false;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (deadline <= now || deadline - now < std::chrono::microseconds(1)) return false;
+		std::chrono::steady_clock::time_point until = now + std::chrono::microseconds(curSpin);
+		bool limited = deadline < until;
+		if (limited) until = deadline;
+		unsigned int i = 0;
+		while (!ready()) {
+			cpuRelax();
+			//reading the clock is not cheap, check it occasionally
+			if ((++i & 63) == 0 && std::chrono::steady_clock::now() >= until) {
+				if (!limited) curSpin = std::max(curSpin / 2, std::max(maxSpin / 16, 1U));
+				return false;
+			}
+		}
+		curSpin = std::min(curSpin * 2, maxSpin);
+		return true;
+	}
+
+protected:
+	unsigned int maxSpin;
+	unsigned int curSpin;
+};
+
+}
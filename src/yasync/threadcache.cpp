@@ -0,0 +1,100 @@
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "threadcache.h"
+
+namespace yasync {
+
+namespace {
+
+	///Parked thread
+	struct Worker {
+		AbstractDispatcher::Fn task;
+		std::condition_variable cond;
+		Worker *next;
+	};
+
+	class Cache {
+	public:
+
+		Cache():idleTimeout(10000),idle(nullptr) {}
+
+		void run(const AbstractDispatcher::Fn &fn) {
+			{
+				std::lock_guard<std::mutex> _(lk);
+				Worker *w = idle;
+				if (w) {
+					idle = w->next;
+					w->task = fn;
+					w->cond.notify_one();
+					return;
+				}
+			}
+			//the task is moved out of the thread function, so it is not held until the thread exits
+			//(non-const copy, a captured const reference would be captured as const)
+			AbstractDispatcher::Fn task = fn;
+			std::thread t([this, task]() mutable {
+				worker(std::move(task));
+			});
+			t.detach();
+		}
+
+		std::atomic<unsigned int> idleTimeout;
+
+	protected:
+		std::mutex lk;
+		///Parked threads, the most recently parked is on the top
+		Worker *idle;
+
+		void worker(AbstractDispatcher::Fn fn) {
+			Worker w;
+			while (fn != nullptr) {
+				fn->execute();
+				fn = nullptr;
+				unsigned int tm = idleTimeout.load(std::memory_order_relaxed);
+				if (tm == 0) return;
+				//the next task must not see state of the previous task
+				IDispatchQueueControl::setThreadQueueControl(nullptr);
+				_hlp::resetThreadDispatcher();
+				_hlp::resetThreadAlerts();
+
+				std::unique_lock<std::mutex> l(lk);
+				w.next = idle;
+				idle = &w;
+				auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(tm);
+				while (w.task == nullptr) {
+					if (w.cond.wait_until(l, until) == std::cv_status::timeout && w.task == nullptr) {
+						//not reused, remove the thread from the cache and exit
+						Worker **p = &idle;
+						while (*p != &w) p = &(*p)->next;
+						*p = w.next;
+						break;
+					}
+				}
+				fn = std::move(w.task);
+			}
+		}
+	};
+
+	Cache &getCache() {
+		//the cache is never destroyed, parked threads can access it during the exit
+		static Cache *cache = new Cache;
+		return *cache;
+	}
+
+}
+
+void ThreadCache::run(const AbstractDispatcher::Fn &fn) {
+	getCache().run(fn);
+}
+
+void ThreadCache::setIdleTimeout(unsigned int ms) {
+	getCache().idleTimeout.store(ms, std::memory_order_relaxed);
+}
+
+unsigned int ThreadCache::getIdleTimeout() {
+	return getCache().idleTimeout.load(std::memory_order_relaxed);
+}
+
+}
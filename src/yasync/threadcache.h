@@ -0,0 +1,43 @@
+#pragma once
+
+#include "dispatcher.h"
+
+namespace yasync {
+
+///Cache of threads used by newThread
+/** Creating a thread is expensive. Threads which finished their task are parked in the cache
+ * and reused for the next tasks. A parked thread exits when it is not reused within the idle
+ * timeout. Every task still gets its own thread, it never waits behind other task.
+ *
+ * The thread is reset before it is reused. Its dispatching queue is closed, so functions
+ * dispatched to the previous task are not executed, alerts sent to the previous task are not
+ * delivered to the next task, and the thread receives a new thisThreadId().
+ */
+class ThreadCache {
+public:
+
+	///Runs the task in a parked thread, or in a new thread when no thread is parked
+	static void run(const AbstractDispatcher::Fn &fn);
+
+	///Sets how long a parked thread waits for a next task
+	/**
+	 * @param ms timeout in milliseconds. Default is 10000. Value 0 disables caching, so
+	 * every thread exits after its task
+	 */
+	static void setIdleTimeout(unsigned int ms);
+
+	///Retrieves current idle timeout
+	static unsigned int getIdleTimeout();
+
+};
+
+namespace _hlp {
+
+	///Detaches the current thread from its alert function and thread id (sandman.cpp)
+	void resetThreadAlerts();
+	///Closes and detaches the dispatching queue of the current thread (dispatcher.cpp)
+	void resetThreadDispatcher();
+
+}
+
+}
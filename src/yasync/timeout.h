@@ -21,12 +21,18 @@ public:
 	///Expires after specified duration
 	template<typename Rep, typename Period>
 	Timeout(const std::chrono::duration<Rep, Period> &dur)
-		: pt(std::chrono::steady_clock::now() + dur) {}
+		: pt(std::chrono::steady_clock::now() + dur), neverExpires(false) {}
 
 
 	static Timeout infinity;
 	static Timeout now() {return Timeout();}
 
+	///returns true if the timeout never expires
+	/** The test doesn't need to read the clock */
+	bool isInfinite() const {
+		return neverExpires;
+	}
+
 	///returns time when expires.
 	/** However, if timeout is set to "never expires" return value is unspecified */
 	operator Clock() const {
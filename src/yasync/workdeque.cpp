@@ -0,0 +1,89 @@
+#include "workdeque.h"
+
+namespace yasync {
+
+WorkDeque::Buffer::Buffer(std::int64_t size, Buffer *prev)
+	:mask(size - 1), items(new std::atomic<Node *>[size]), prev(prev) {}
+
+WorkDeque::Buffer::~Buffer() {
+	delete [] items;
+}
+
+WorkDeque::WorkDeque():top(0),bottom(0),buffer(new Buffer(64, nullptr)) {}
+
+WorkDeque::~WorkDeque() {
+	Fn fn = take();
+	while (fn != nullptr) fn = take();
+	Buffer *b = buffer.load(std::memory_order_relaxed);
+	while (b) {
+		Buffer *p = b->prev;
+		delete b;
+		b = p;
+	}
+}
+
+WorkDeque::Buffer *WorkDeque::grow(Buffer *b, std::int64_t t, std::int64_t btm) {
+	Buffer *nb = new Buffer((b->mask + 1) * 2, b);
+	for (std::int64_t i = t; i < btm; i++) nb->put(i, b->get(i));
+	buffer.store(nb, std::memory_order_release);
+	return nb;
+}
+
+void WorkDeque::push(const Fn &fn) {
+	Node *n = fn;
+	std::int64_t b = bottom.load(std::memory_order_relaxed);
+	std::int64_t t = top.load(std::memory_order_acquire);
+	Buffer *buf = buffer.load(std::memory_order_relaxed);
+	if (b - t > buf->mask) buf = grow(buf, t, b);
+	//the deque holds the reference
+	n->addRef();
+	buf->put(b, n);
+	bottom.store(b + 1, std::memory_order_release);
+}
+
+WorkDeque::Fn WorkDeque::take() throw() {
+	std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	Buffer *buf = buffer.load(std::memory_order_relaxed);
+	//announce the take before top is read, thieves can't pass this item unnoticed
+	bottom.store(b, std::memory_order_seq_cst);
+	std::int64_t t = top.load(std::memory_order_seq_cst);
+	if (t > b) {
+		//empty
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	Node *n = buf->get(b);
+	if (t == b) {
+		//last item, race with thieves
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			n = nullptr;
+		}
+		bottom.store(b + 1, std::memory_order_relaxed);
+		if (n == nullptr) return nullptr;
+	}
+	Fn res(n);
+	n->release();
+	return res;
+}
+
+WorkDeque::Fn WorkDeque::steal() throw() {
+	std::int64_t t = top.load(std::memory_order_seq_cst);
+	std::int64_t b = bottom.load(std::memory_order_seq_cst);
+	if (t >= b) return nullptr;
+	Buffer *buf = buffer.load(std::memory_order_acquire);
+	Node *n = buf->get(t);
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		return nullptr;
+	}
+	Fn res(n);
+	n->release();
+	return res;
+}
+
+std::size_t WorkDeque::size() const throw() {
+	std::int64_t b = bottom.load(std::memory_order_relaxed);
+	std::int64_t t = top.load(std::memory_order_relaxed);
+	return b > t ? static_cast<std::size_t>(b - t) : 0;
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "dispatcher.h"
+
+namespace yasync {
+
+///Work-stealing deque of dispatched functions (Chase-Lev)
+/** The owner thread pushes and takes functions at the bottom of the deque (LIFO), other
+ * threads steal functions from the top of the deque (FIFO). Owner's operations don't
+ * need any lock, stealing uses single CAS. The deque grows when it is full. Replaced
+ * buffers are kept until the deque is destroyed, because a thief can still read them.
+ *
+ * Only the owner can call push() and take(). Any thread can call steal()
+ */
+class WorkDeque {
+public:
+	typedef AbstractDispatcher::Fn Fn;
+
+	WorkDeque();
+	~WorkDeque();
+
+	///Pushes function to the bottom
+	/** @note owner only */
+	void push(const Fn &fn);
+
+	///Takes function from the bottom
+	/**
+	 * @return function or nullptr if the deque is empty
+	 * @note owner only */
+	Fn take() throw();
+
+	///Steals function from the top
+	/**
+	 * @return function or nullptr if the deque is empty or other thread won the race
+	 */
+	Fn steal() throw();
+
+	///Returns approximate count of functions in the deque
+	std::size_t size() const throw();
+
+	///Returns true, when deque appears empty
+	bool empty() const throw() {return size() == 0;}
+
+	WorkDeque(const WorkDeque &) = delete;
+	WorkDeque &operator=(const WorkDeque &) = delete;
+
+protected:
+	typedef AbstractDispatchedFunction Node;
+
+	struct Buffer {
+		std::int64_t mask;
+		std::atomic<Node *> *items;
+		///previous (smaller) buffer, kept for thieves
+		Buffer *prev;
+
+		Buffer(std::int64_t size, Buffer *prev);
+		~Buffer();
+		Node *get(std::int64_t i) const {return items[i & mask].load(std::memory_order_relaxed);}
+		void put(std::int64_t i, Node *n) {items[i & mask].store(n, std::memory_order_relaxed);}
+	};
+
+	std::atomic<std::int64_t> top;
+	std::atomic<std::int64_t> bottom;
+	std::atomic<Buffer *> buffer;
+
+	Buffer *grow(Buffer *b, std::int64_t t, std::int64_t btm);
+};
+
+}
@@ -0,0 +1,504 @@
+/*
+ * wspool.cpp
+ *
+ * Work-stealing implementation of the ThreadPool
+ */
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "wspool.h"
+
+#include "condvar.h"
+#include "gate.h"
+#include "fastmutex.h"
+#include "nulllock.h"
+#include "timeout.h"
+#include "workdeque.h"
+
+namespace yasync {
+
+	class WorkStealingPool;
+	typedef RefCntPtr<WorkStealingPool> PWSPool;
+
+	///Thread pool where every worker has own deque
+	/** Functions dispatched by a worker of the pool are pushed to the worker's deque. Other
+	 * functions are pushed to the shared injection queue. A worker processes its own deque
+	 * first (LIFO), then it takes functions from the injection queue and finally it steals
+	 * functions from deques of other workers (FIFO), starting by a random victim.
+	 */
+	class WorkStealingPool: public AbstractDispatcher {
+	public:
+
+		typedef ThreadPool Config;
+
+		WorkStealingPool(const Config &cfg);
+		~WorkStealingPool() {
+			cfg.getFinalStop()();
+		}
+
+		DispatchFn createControl();
+		void startMinThreads();
+
+		virtual bool dispatch(const Fn &fn) throw();
+		virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw();
+		void finish();
+		bool yield(unsigned int recursion) throw();
+		void yieldOrHalt(unsigned int recursion) throw();
+
+	protected:
+
+		struct Worker {
+			WorkDeque deque;
+			std::uint32_t seed;
+		};
+
+		class Control: public AbstractDispatcher {
+		public:
+
+			Control(const PWSPool &pool):pool(pool) {}
+
+			virtual bool dispatch(const Fn &fn) throw() {
+				return pool->dispatch(fn);
+			}
+			virtual std::size_t dispatchMany(const Fn *fns, std::size_t count) throw() {
+				return pool->dispatchMany(fns, count);
+			}
+			virtual std::size_t getQueueDepth(Priority priority) throw() {
+				//the pool has no lanes, whole injection queue is reported as normal
+				return priority == normalPriority?pool->injectedCount.load(std::memory_order_relaxed):0;
+			}
+			virtual ~Control() {
+				pool->finish();
+			}
+
+			void operator delete(void *, std::size_t) {}
+		protected:
+			PWSPool pool;
+		};
+
+		class QueueState;
+
+		Config cfg;
+		///all workers, one for each possible thread
+		std::unique_ptr<Worker[]> workers;
+		unsigned int workerCount;
+		///guards injection queue and state of threads
+		FastMutex lk;
+		CondVar<NullLock> workerTrigger;
+		CondVar<NullLock> queueTrigger;
+		std::deque<Fn> injected;
+		///functions dispatched by dispatchAsync() waiting for space in the injection queue
+		std::deque<Fn> deferred;
+		///count of items in injection queue - readable without lock
+		std::atomic<std::size_t> injectedCount;
+		///unused workers
+		std::vector<unsigned int> freeWorkers;
+		std::atomic<unsigned int> threadCount;
+		///count of workers preparing to sleep or sleeping
+		std::atomic<unsigned int> idleCount;
+		bool finishFlag;
+		///counts workers started by start() while it waits for them
+		CountGate *readyGate;
+
+		unsigned char controlSpace[sizeof(Control)];
+
+		Worker *currentWorker() const;
+		bool inject(const Fn &fn);
+		void signalWork(std::size_t count);
+		void wakeWorkers(std::size_t count);
+		void startThread();
+		void runWorker(unsigned int id) throw();
+		Fn findTask(Worker &w) throw();
+		Fn takeInjected(Worker &w) throw();
+		Fn stealTask(Worker &w) throw();
+		bool hasWork() const throw();
+		bool park(unsigned int id) throw();
+		bool keepAlive() const;
+	};
+
+	static thread_local WorkStealingPool *curPool = nullptr;
+	static thread_local void *curWorker = nullptr;
+
+	class WorkStealingPool::QueueState: public IDispatchQueueControl {
+	public:
+		QueueState(WorkStealingPool *pool):pool(pool),recursionCount(0) {}
+
+		virtual bool yield()  throw() {
+			recursionCount++;
+			bool res = pool->yield(recursionCount);
+			recursionCount--;
+			return res;
+		}
+		virtual void yieldOrHalt() throw() {
+			recursionCount++;
+			pool->yieldOrHalt(recursionCount);
+			recursionCount--;
+		}
+		virtual DispatchFn getDispatch() throw() {
+			return RefCntPtr<AbstractDispatcher>(pool);
+		}
+
+		WorkStealingPool *pool;
+		unsigned int recursionCount;
+	};
+
+	WorkStealingPool::WorkStealingPool(const Config &cfg)
+		:cfg(cfg)
+		,workers(new Worker[cfg.getMaxThreads()])
+		,workerCount(cfg.getMaxThreads())
+		,workerTrigger(nullLock,true)
+		,queueTrigger(nullLock,false)
+		,injectedCount(0)
+		,threadCount(0)
+		,idleCount(0)
+		,finishFlag(false)
+		,readyGate(nullptr) {
+		for (unsigned int i = workerCount; i > 0; i--) {
+			freeWorkers.push_back(i - 1);
+			workers[i - 1].seed = i * 2654435761U;
+		}
+	}
+
+	DispatchFn WorkStealingPool::createControl() {
+		void *p = controlSpace;
+		RefCntPtr<AbstractDispatcher> d(new(p) Control(this));
+		return DispatchFn(d);
+	}
+
+	void WorkStealingPool::startMinThreads() {
+		unsigned int n = std::min(cfg.getMinThreads(), workerCount);
+		if (n == 0) return;
+		CountGate ready(n);
+		{
+			LockScope<FastMutex> _(lk);
+			if (cfg.isWaitForMinThreads()) readyGate = &ready;
+			while (threadCount.load(std::memory_order_relaxed) < n) startThread();
+		}
+		if (cfg.isWaitForMinThreads()) {
+			ready.wait();
+			LockScope<FastMutex> _(lk);
+			readyGate = nullptr;
+		}
+	}
+
+	bool WorkStealingPool::keepAlive() const {
+		return !finishFlag && threadCount.load(std::memory_order_relaxed) <= cfg.getMinThreads();
+	}
+
+	WorkStealingPool::Worker *WorkStealingPool::currentWorker() const {
+		return curPool == this ? static_cast<Worker *>(curWorker) : nullptr;
+	}
+
+	bool WorkStealingPool::dispatch(const Fn &fn) throw() {
+		Worker *w = currentWorker();
+		if (w && fn != nullptr) {
+			//dispatched by own worker - push to the local deque without any lock
+			w->deque.push(fn);
+			signalWork(1);
+			return true;
+		}
+		return inject(fn);
+	}
+
+	std::size_t WorkStealingPool::dispatchMany(const Fn *fns, std::size_t count) throw() {
+		Worker *w = currentWorker();
+		if (w) {
+			std::size_t added = 0;
+			for (std::size_t i = 0; i < count; i++) {
+				if (fns[i] == nullptr) {
+					inject(fns[i]);
+				} else {
+					w->deque.push(fns[i]);
+					added++;
+				}
+			}
+			signalWork(added);
+			return count;
+		}
+		std::size_t processed = 0;
+		{
+			LockScope<FastMutex> _(lk);
+			std::size_t added = 0;
+			while (processed < count && injected.size() < cfg.getMaxQueue()) {
+				const Fn &fn = fns[processed];
+				if (fn == ThreadPool::clearQueueCmd) {
+					injected.clear();
+					deferred.clear();
+					added = 0;
+				} else {
+					injected.push_back(fn);
+					added++;
+				}
+				injectedCount.store(injected.size(), std::memory_order_seq_cst);
+				processed++;
+			}
+			wakeWorkers(added);
+		}
+		while (processed < count && inject(fns[processed])) processed++;
+		return processed;
+	}
+
+	bool WorkStealingPool::inject(const Fn &fn) {
+		//dropped function must be released outside of the lock
+		Fn dropped;
+		LockScope<FastMutex> _(lk);
+		if (fn == ThreadPool::clearQueueCmd) {
+			injected.clear();
+			deferred.clear();
+			injectedCount.store(0, std::memory_order_seq_cst);
+			queueTrigger.notifyAll();
+			return true;
+		}
+		if (injected.size() >= cfg.getMaxQueue()) {
+			//asynchronous dispatch never waits, the function waits aside
+			AbstractDispatchedFunction *p = fn;
+			AbstractAsyncDispatchedFunction *a = dynamic_cast<AbstractAsyncDispatchedFunction *>(p);
+			if (a) {
+				a->defer();
+				deferred.push_back(fn);
+				return true;
+			}
+			switch (cfg.getOverflowPolicy()) {
+			case ThreadPool::reject:
+				return false;
+			case ThreadPool::callerRuns: {
+					UnlockScope<FastMutex> _(lk);
+					fn->execute();
+					return true;
+				}
+			case ThreadPool::dropOldest:
+				dropped = std::move(injected.front());
+				injected.pop_front();
+				break;
+			default: {
+					Timeout tm(cfg.getQueueTimeout() == 0?Timeout(nullptr):Timeout(cfg.getQueueTimeout()));
+					bool dow = cfg.isDispatchOnWait();
+					bool timeouted = false;
+					while (injected.size() >= cfg.getMaxQueue() && !timeouted) {
+						auto t = queueTrigger.ticket();
+						UnlockScope<FastMutex> _(lk);
+						while (!t && !timeouted) {
+							timeouted = dow ? sleepAndDispatch(tm) : ::yasync::sleep(tm);
+						}
+					}
+					if (injected.size() >= cfg.getMaxQueue()) return false;
+				}
+				break;
+			}
+		}
+		injected.push_back(fn);
+		injectedCount.store(injected.size(), std::memory_order_seq_cst);
+		wakeWorkers(1);
+		return true;
+	}
+
+	void WorkStealingPool::signalWork(std::size_t count) {
+		//the push must be visible before idle workers are counted
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (idleCount.load(std::memory_order_seq_cst) > 0
+				|| threadCount.load(std::memory_order_relaxed) < workerCount) {
+			LockScope<FastMutex> _(lk);
+			wakeWorkers(count);
+		}
+	}
+
+	void WorkStealingPool::wakeWorkers(std::size_t count) {
+		while (count && workerTrigger.notifyOne()) count--;
+		while (count && threadCount.load(std::memory_order_relaxed) < workerCount) {
+			startThread();
+			count--;
+		}
+	}
+
+	void WorkStealingPool::finish() {
+		LockScope<FastMutex> _(lk);
+		finishFlag = true;
+		workerTrigger.notifyAll();
+	}
+
+	bool WorkStealingPool::yield(unsigned int recursion) throw() {
+		if (recursion > cfg.getMaxYieldRecursion()) return false;
+		Worker *w = currentWorker();
+		if (w == nullptr) return false;
+		Fn fn = findTask(*w);
+		if (fn == nullptr) return false;
+		fn->execute();
+		return true;
+	}
+
+	void WorkStealingPool::yieldOrHalt(unsigned int recursion) throw() {
+		Worker *w = currentWorker();
+		if (recursion > cfg.getMaxYieldRecursion() || w == nullptr) {
+			halt();
+			return;
+		}
+		Fn fn = findTask(*w);
+		if (fn == nullptr) {
+			bool notified;
+			{
+				LockScope<FastMutex> _(lk);
+				//wait as an idle worker, so a new task wakes this thread
+				auto t = workerTrigger.ticket();
+				idleCount.fetch_add(1, std::memory_order_seq_cst);
+				{
+					UnlockScope<FastMutex> _(lk);
+					//recheck after the worker is counted as idle, otherwise a push can be missed
+					if (!hasWork()) halt();
+				}
+				idleCount.fetch_sub(1, std::memory_order_seq_cst);
+				notified = t;
+			}
+			//alerted by other reason
+			if (!notified) return;
+			//notified worker must take the task, otherwise the notification is lost
+			fn = findTask(*w);
+			if (fn == nullptr) return;
+		}
+		fn->execute();
+	}
+
+	void WorkStealingPool::startThread() {
+		PWSPool me = this;
+		unsigned int id = freeWorkers.back();
+		freeWorkers.pop_back();
+		++threadCount;
+		::yasync::newThread >> [me, id] {
+			me->runWorker(id);
+		};
+	}
+
+	WorkStealingPool::Fn WorkStealingPool::findTask(Worker &w) throw() {
+		Fn fn = w.deque.take();
+		if (fn != nullptr) return fn;
+		fn = takeInjected(w);
+		if (fn != nullptr) return fn;
+		return stealTask(w);
+	}
+
+	WorkStealingPool::Fn WorkStealingPool::takeInjected(Worker &w) throw() {
+		if (injectedCount.load(std::memory_order_seq_cst) == 0) return nullptr;
+		Fn fn;
+		std::vector<Fn> promoted;
+		{
+			LockScope<FastMutex> _(lk);
+			if (injected.empty()) return nullptr;
+			fn = std::move(injected.front());
+			injected.pop_front();
+			//move a fair share of the queue to the local deque, so the lock is not taken for each task
+			std::size_t share = std::min<std::size_t>(injected.size() / (threadCount.load(std::memory_order_relaxed) + 1), 32);
+			for (std::size_t i = 0; i < share; i++) {
+				w.deque.push(injected.front());
+				injected.pop_front();
+			}
+			//space in the queue is given to the deferred functions first
+			while (!deferred.empty() && injected.size() < cfg.getMaxQueue()) {
+				injected.push_back(std::move(deferred.front()));
+				deferred.pop_front();
+				promoted.push_back(injected.back());
+			}
+			injectedCount.store(injected.size(), std::memory_order_seq_cst);
+			if (injected.size() < cfg.getMaxQueue()) queueTrigger.notifyAll();
+		}
+		//futures are resolved outside of the lock
+		for (auto &&x : promoted) {
+			AbstractDispatchedFunction *p = x;
+			static_cast<AbstractAsyncDispatchedFunction *>(p)->setQueued();
+		}
+		return fn;
+	}
+
+	WorkStealingPool::Fn WorkStealingPool::stealTask(Worker &w) throw() {
+		//xorshift
+		std::uint32_t x = w.seed;
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		w.seed = x;
+		unsigned int start = x % workerCount;
+		for (unsigned int i = 0; i < workerCount; i++) {
+			Worker &victim = workers[(start + i) % workerCount];
+			if (&victim == &w || victim.deque.empty()) continue;
+			Fn fn = victim.deque.steal();
+			if (fn != nullptr) return fn;
+		}
+		return nullptr;
+	}
+
+	bool WorkStealingPool::hasWork() const throw() {
+		if (injectedCount.load(std::memory_order_seq_cst)) return true;
+		for (unsigned int i = 0; i < workerCount; i++) {
+			if (!workers[i].deque.empty()) return true;
+		}
+		return false;
+	}
+
+	bool WorkStealingPool::park(unsigned int id) throw() {
+		LockScope<FastMutex> _(lk);
+		//workers up to minThreads are never retired
+		Timeout tm(keepAlive()?Timeout(nullptr):Timeout(cfg.getIdleTimeout()));
+		do {
+			if (!injected.empty()) return true;
+			if (finishFlag && !hasWork()) break;
+			bool found = false;
+			bool timeouted = false;
+			auto t = workerTrigger.ticket();
+			idleCount.fetch_add(1, std::memory_order_seq_cst);
+			{
+				UnlockScope<FastMutex> _(lk);
+				//recheck after the worker is counted as idle, otherwise a push can be missed
+				found = hasWork();
+				while (!found && !t && !timeouted) {
+					timeouted = ::yasync::sleep(tm);
+				}
+			}
+			idleCount.fetch_sub(1, std::memory_order_seq_cst);
+			if (found || t) return true;
+			if (timeouted) {
+				if (!keepAlive()) break;
+				tm = Timeout(nullptr);
+			}
+		} while (true);
+		//no more work for this worker, release it
+		--threadCount;
+		freeWorkers.push_back(id);
+		return false;
+	}
+
+	void WorkStealingPool::runWorker(unsigned int id) throw() {
+		Worker &w = workers[id];
+		QueueState st(this);
+		IDispatchQueueControl::setThreadQueueControl(&st);
+		curPool = this;
+		curWorker = &w;
+
+		//idle worker spins a while before it is parked
+		setThreadSpinTime(cfg.getSpinTime());
+		cfg.getThreadStart()();
+		{
+			LockScope<FastMutex> _(lk);
+			if (readyGate) (*readyGate)();
+		}
+
+		do {
+			Fn fn = findTask(w);
+			while (fn != nullptr) {
+				fn->execute();
+				fn = findTask(w);
+			}
+		} while (park(id));
+
+		cfg.getThreadStop()();
+		setThreadSpinTime(0);
+
+		curPool = nullptr;
+		curWorker = nullptr;
+		IDispatchQueueControl::setThreadQueueControl(nullptr);
+	}
+
+	DispatchFn startWorkStealingPool(const ThreadPool &cfg) {
+		PWSPool pool = new WorkStealingPool(cfg);
+		DispatchFn d = pool->createControl();
+		pool->startMinThreads();
+		return d;
+	}
+
+}
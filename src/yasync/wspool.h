@@ -0,0 +1,12 @@
+#pragma once
+
+#include "pool.h"
+
+namespace yasync {
+
+///Starts the thread pool in work-stealing mode
+/** Implementation of ThreadPool::start() when the work stealing is enabled
+ * @see ThreadPool::setWorkStealing */
+DispatchFn startWorkStealingPool(const ThreadPool &cfg);
+
+}